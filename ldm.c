@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -11,10 +12,34 @@
 #include <sys/inotify.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/fanotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <endian.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <dlfcn.h>
 #include <libmount/libmount.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "ldm_plugin.h"
 
 #define VERSION_STR "0.4.3"
+#define MAX_DEVLINKS 16
+#define PROPS_DRAFT  8192
+#define UEVENT_BATCH 128
+#define UEVENT_BUF_SIZE 8192
 
 enum {
     DEVICE_VOLUME,
@@ -22,64 +47,709 @@ enum {
     DEVICE_UNK
 };
 
+/* The device lifecycle, a device is busy while a worker owns it */
+enum {
+    DEVICE_STATE_PROBING,
+    DEVICE_STATE_MOUNTING,
+    DEVICE_STATE_MOUNTED,
+    DEVICE_STATE_UNMOUNTING
+};
+
+enum {
+    EVENT_ADD,
+    EVENT_REMOVE,
+    EVENT_CHANGE,
+    EVENT_UNK
+};
+
+enum {
+    JOB_MOUNT,
+    JOB_UNMOUNT
+};
+
+enum {
+    MTAB_UNKNOWN,
+    MTAB_PROCFS,
+    MTAB_LISTMOUNT
+};
+
 enum {
     QUIRK_NONE = 0,
     QUIRK_OWNER_FIX = (1<<0),
     QUIRK_UTF8_FLAG = (1<<1)
 };
 
+enum {
+    IGNORE_DEVTYPE,
+    IGNORE_NAME,
+    IGNORE_MAJOR,
+    IGNORE_TAG
+};
+
+/* Intrusive hash table node, embedded in the objects it indexes */
+typedef struct hnode_t {
+    struct hnode_t      *next;
+    unsigned long        hash;
+    const char          *key;
+    uint64_t             num;
+    void                *data;
+} hnode_t;
+
+typedef struct htable_t {
+    struct hnode_t     **buckets;
+    unsigned long        size;
+    unsigned long        count;
+} htable_t;
+
+/* A mount as listed in mountinfo, the strings live in data */
+typedef struct mount_t {
+    uint64_t             id;
+    dev_t                devnum;
+    unsigned long        seen;
+    char                *source;
+    char                *target;
+    struct hnode_t       by_id;
+    struct hnode_t       by_devnum;
+    struct hnode_t       by_source;
+    struct mount_t      *prev;
+    struct mount_t      *next;
+    char                 data[];
+} mount_t;
+
+/* A cache of fixed size objects, the free ones are chained through their
+ * first word */
+typedef struct slab_t {
+    size_t               size;
+    void                *free;
+    void                *chunks;
+} slab_t;
+
+/* One of the names an fstab entry goes by: its source path or a
+ * UUID=/LABEL=/PARTUUID= tag. The first entry wins, as with a forward walk */
+typedef struct fstab_key_t {
+    int                  noauto;
+    char                *target;
+    char                *options;
+    struct hnode_t       node;
+    struct fstab_key_t  *next;
+    char                 data[];
+} fstab_key_t;
+
+typedef struct fstab_index_t {
+    struct htable_t      keys;
+    struct fstab_key_t  *head;
+} fstab_index_t;
+
+/* A name in use under MOUNT_PATH, and the suffix counter of its base name */
+typedef struct mpname_t {
+    struct mpbase_t     *base;
+    struct hnode_t       node;
+    char                *name;
+    char                 path[];
+} mpname_t;
+
+typedef struct mpbase_t {
+    unsigned long        suffix;
+    unsigned long        users;
+    struct hnode_t       node;
+    char                 name[];
+} mpbase_t;
+
+/* The bits of a udev device we care about, taken once per event. Shared by
+ * the events and the device they end up creating, the strings live in data
+ * or are interned */
+typedef struct props_t {
+    int                  refs;
+    dev_t                devnum;
+    uint64_t             diskseq;
+    uint64_t             size;
+    int                  cdrom_media;
+    const char          *devnode;
+    const char          *devtype;
+    const char          *fs_type;
+    const char          *fs_uuid;
+    const char          *fs_label;
+    const char          *fs_usage;
+    const char          *id_type;
+    const char          *serial;
+    const char          *part_uuid;
+    int                  ndevlinks;
+    const char          *devlinks[MAX_DEVLINKS];
+    /* The strings follow */
+} props_t;
+
+/* Where a snapshot is put together before it's packed in a single
+ * allocation that's just big enough */
+typedef struct props_draft_t {
+    struct props_t       props;
+    size_t               used;
+    char                 pool[PROPS_DRAFT];
+} props_draft_t;
+
+/* An event that arrived while its device was busy, replayed in order */
+typedef struct pending_t {
+    int                  action;
+    struct props_t      *props;
+    struct pending_t    *next;
+} pending_t;
+
+/* Anything the main loop waits on */
+typedef struct ev_source_t {
+    int                  fd;
+    void               (*cb)(struct ev_source_t *src, uint32_t events);
+    void                *data;
+} ev_source_t;
+
+typedef struct ev_timer_t {
+    struct ev_source_t   src;
+    void               (*cb)(struct ev_timer_t *timer);
+    void                *data;
+} ev_timer_t;
+
+/* The mount table, indexed by mount id, major:minor and source. The ids
+ * are the unique 64 bit ones when listmount is around, the mountinfo ones
+ * otherwise */
+typedef struct mtab_t {
+    int                  backend;
+    int                  no_source;
+    /* Change notifications are coalesced and the ones we caused are skipped */
+    struct ev_timer_t    timer;
+    int64_t              timer_deadline;
+    int64_t              last_reload;
+    int64_t              verify_deadline;
+    unsigned int         notified;
+    unsigned int         self_changes;
+    struct htable_t      ids;
+    struct htable_t      devnums;
+    struct htable_t      sources;
+    struct mount_t      *head;
+    unsigned long        generation;
+    char                *buf;
+    size_t               bufsize;
+} mtab_t;
+
+/* A running or queued CALLBACK_PATH invocation */
+typedef struct helper_t {
+    pid_t                pid;
+    char                *path;
+    char                *action;
+    char                *mountpoint;
+    struct ev_source_t   src;
+    struct ev_timer_t    timer;
+    int64_t              deadline;
+    int                  killed;
+    struct helper_t     *next;
+} helper_t;
+
+/* The long-lived COPROC_PATH helper, fed through a pipe on its stdin */
+typedef struct coproc_t {
+    const char          *path;
+    pid_t                pid;
+    int                  fd;
+    int                  midrecord;
+    struct ev_source_t   exit_src;
+    struct ev_source_t   out_src;
+    struct ev_timer_t    restart;
+    size_t               len;
+    char                *buf;
+} coproc_t;
+
+typedef struct plugin_t {
+    void                *handle;
+    void               (*on_mount)(const ldm_event *);
+    void               (*on_unmount)(const ldm_event *);
+    void               (*fini)(void);
+} plugin_t;
+
+/* An event waiting for the plugin thread, the strings live in data */
+typedef struct plugin_event_t {
+    struct ldm_event     ev;
+    struct plugin_event_t *next;
+    char                 data[];
+} plugin_event_t;
+
+/* The net effect of the events seen for a devnode during the window */
+typedef struct debounce_t {
+    int                  action;
+    int64_t              deadline;
+    struct props_t      *props;
+    struct hnode_t       node;
+    struct debounce_t   *next;
+    struct debounce_t   *prev;
+} debounce_t;
+
 typedef struct device_t  {
     int                  type;
-    char                *filesystem;
-    char                *devnode;
+    int                  state;
+    dev_t                devnum;
+    const char          *filesystem;
+    const char          *devnode;
     char                *mountpoint;
-    struct udev_device  *udev;
+    /* Owned by the name table if reserved */
+    int                  mountpoint_reserved;
+    /* What identifies the media that got mounted */
+    const char          *uuid;
+    uint64_t             diskseq;
+    uint64_t             size;
+    struct props_t      *props;
+    struct pending_t    *pending;
+    struct pending_t    *pending_tail;
+    /* Registry bookkeeping */
+    int                  registered;
+    struct device_t     *prev;
+    struct device_t     *next;
+    struct hnode_t       by_devnode;
+    struct hnode_t       by_mountpoint;
+    struct hnode_t       by_devnum;
 } device_t;
 
+/* Every known device, indexed by /dev node, mountpoint and major:minor */
+typedef struct registry_t {
+    struct htable_t      devnodes;
+    struct htable_t      mountpoints;
+    struct htable_t      devnums;
+    struct device_t     *head;
+    unsigned long        count;
+    /* Changed since the last snapshot */
+    int                  dirty;
+} registry_t;
+
+/* An immutable copy of the registry for the status readers, the strings
+ * follow the entries */
+typedef struct snap_entry_t {
+    const char          *devnode;
+    const char          *mountpoint;
+    const char          *filesystem;
+    int                  state;
+} snap_entry_t;
+
+typedef struct snapshot_t {
+    unsigned long        version;
+    unsigned long        retired;
+    struct snapshot_t   *next;
+    int                  count;
+    struct snap_entry_t  entries[];
+} snapshot_t;
+
+/* A status query waiting for a reader, fd is the client's connection */
+typedef struct status_req_t {
+    struct status_req_t *next;
+    int                  fd;
+} status_req_t;
+
+/* A mount or unmount request handed to the worker pool. The device strings
+ * are never modified while a job is in flight so the workers can read them */
+typedef struct job_t {
+    int                  type;
+    struct device_t     *device;
+    char                 options[256];
+    unsigned long        mflags;
+    int                  owner_fix;
+    unsigned int         mnt_id_mask;
+    uint64_t             mnt_id;
+    int                  ret;
+    int                  err;
+    struct job_t        *next;
+} job_t;
+
 typedef struct fs_quirk_t {
     char *name;
     int quirks;
 } fs_quirk_t;
 
+/* A -i rule, names are matched by prefix */
+typedef struct ignore_t {
+    int                  kind;
+    unsigned int         major;
+    const char          *value;
+    size_t               len;
+} ignore_t;
+
+/* What udev puts in front of the properties it multicasts */
+typedef struct uevent_hdr_t {
+    char                 prefix[8];
+    uint32_t             magic;
+    uint32_t             header_size;
+    uint32_t             properties_off;
+    uint32_t             properties_len;
+    uint32_t             filter_subsystem_hash;
+    uint32_t             filter_devtype_hash;
+    uint32_t             filter_tag_bloom_hi;
+    uint32_t             filter_tag_bloom_lo;
+} uevent_hdr_t;
+
+/* The properties we care about, pointing in the receive buffer */
+typedef struct uevent_t {
+    const char          *action;
+    const char          *devpath;
+    const char          *subsystem;
+    const char          *devname;
+    const char          *devtype;
+    const char          *major;
+    const char          *minor;
+    const char          *diskseq;
+    const char          *tags;
+    char                *devlinks;
+    const char          *fs_type;
+    const char          *fs_uuid;
+    const char          *fs_label;
+    const char          *fs_usage;
+    const char          *id_type;
+    const char          *serial;
+    const char          *part_uuid;
+    int                  cdrom_media;
+} uevent_t;
+
+/* Everything recvmmsg needs for a batch, allocated once */
+typedef struct uevent_ring_t {
+    struct mmsghdr       msgs[UEVENT_BATCH];
+    struct iovec         iov[UEVENT_BATCH];
+    struct sockaddr_nl   addr[UEVENT_BATCH];
+    char                 cmsg[UEVENT_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+    char                 buf[UEVENT_BATCH][UEVENT_BUF_SIZE];
+} uevent_ring_t;
+
 #define MOUNT_PATH      "/mnt/"
 #define CALLBACK_PATH   NULL
+#define COPROC_PATH     NULL
 #define OPT_FMT         "uid=%i,gid=%i"
-#define MAX_DEVICES     20
-#define FSTAB_PATH      "/etc/fstab"
-#define MTAB_PATH       "/proc/self/mounts"
+#define HTABLE_MIN_SIZE 16
+#define MAX_WORKERS     32
+#define PARALLEL_JOBS   4
+#define MAX_EVENTS      32
+#define MAX_HELPERS     4
+#define HELPER_TIMEOUT  30000   /* msec */
+#define HELPER_POLL     100     /* msec */
+#define COPROC_BUF_SIZE 65536
+#define COPROC_RESTART  1000    /* msec */
+#define MAX_PLUGINS     8
+#define DEBOUNCE_WINDOW 50      /* msec */
+#define SLAB_CHUNK      32
+#define STATUS_THREADS  2
+#define ENUM_THREADS    4
+#define ENUM_BATCH      32
+#define MAX_IGNORE      32
+#define RCVBUF_SIZE     (8 * 1024 * 1024)
+#define RESYNC_DELAY    100     /* msec */
+#define UEVENT_MAGIC    0xfeedcafe
+#define STATUS_TIMEOUT  5000    /* msec */
+#define SLAB_ALIGN      16
+#define SLAB_INIT(t)    { (sizeof(t) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1), NULL, NULL }
+#define FSTAB_DIR       "/etc/"
+#define FSTAB_NAME      "fstab"
+#define FSTAB_PATH      FSTAB_DIR FSTAB_NAME
+#define MTAB_PATH       "/proc/self/mountinfo"
+#define LISTMOUNT_BATCH 512
+#define MTAB_COALESCE   20      /* msec */
+#define MTAB_INTERVAL   250     /* msec */
+#define MTAB_MAX_STALE  2000    /* msec */
 #define LOCK_PATH       "/run/ldm.pid"
 #define FIFO_PATH       "/run/ldm.fifo"
+#define STATUS_PATH     "/run/ldm.sock"
+
+/* listmount(2)/statmount(2), Linux 6.8 onwards. The structures are spelled
+ * out here since the libc headers may well predate them */
+
+#ifndef SYS_statmount
+#define SYS_statmount   457
+#endif
+#ifndef SYS_listmount
+#define SYS_listmount   458
+#endif
+#ifndef LSMT_ROOT
+#define LSMT_ROOT               UINT64_MAX
+#endif
+#ifndef STATX_MNT_ID_UNIQUE
+#define STATX_MNT_ID_UNIQUE     0x00004000U
+#endif
+#ifndef STATMOUNT_SB_BASIC
+#define STATMOUNT_SB_BASIC      0x00000001U
+#endif
+#ifndef STATMOUNT_MNT_POINT
+#define STATMOUNT_MNT_POINT     0x00000010U
+#endif
+#ifndef STATMOUNT_SB_SOURCE
+#define STATMOUNT_SB_SOURCE     0x00000200U
+#endif
+
+/* The new mount API, Linux 5.2 onwards */
+
+#ifndef SYS_move_mount
+#define SYS_move_mount  429
+#endif
+#ifndef SYS_fsopen
+#define SYS_fsopen      430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig    431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount     432
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC          0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC         0x00000001
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG       0
+#define FSCONFIG_SET_STRING     1
+#define FSCONFIG_CMD_CREATE     6
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY       0x00000001
+#define MOUNT_ATTR_NOSUID       0x00000002
+#define MOUNT_ATTR_NODEV        0x00000004
+#define MOUNT_ATTR_NOEXEC       0x00000008
+#endif
+
+/* fanotify mount notifications, Linux 6.15 onwards */
+
+#ifndef FAN_REPORT_MNT
+#define FAN_REPORT_MNT          0x00004000
+#endif
+#ifndef FAN_MARK_MNTNS
+#define FAN_MARK_MNTNS          0x00000110
+#endif
+#ifndef FAN_MNT_ATTACH
+#define FAN_MNT_ATTACH          0x01000000
+#endif
+#ifndef FAN_MNT_DETACH
+#define FAN_MNT_DETACH          0x02000000
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_MNT
+#define FAN_EVENT_INFO_TYPE_MNT 7
+#endif
+
+typedef struct ldm_fan_info_mnt {
+    struct fanotify_event_info_header hdr;
+    uint64_t             mnt_id;
+} ldm_fan_info_mnt;
+
+typedef struct ldm_mnt_id_req {
+    uint32_t             size;
+    uint32_t             spare;
+    uint64_t             mnt_id;
+    uint64_t             param;
+} ldm_mnt_id_req;
+
+typedef struct ldm_statmount {
+    uint32_t             size;
+    uint32_t             mnt_opts;
+    uint64_t             mask;
+    uint32_t             sb_dev_major;
+    uint32_t             sb_dev_minor;
+    uint64_t             sb_magic;
+    uint32_t             sb_flags;
+    uint32_t             fs_type;
+    uint64_t             mnt_id;
+    uint64_t             mnt_parent_id;
+    uint32_t             mnt_id_old;
+    uint32_t             mnt_parent_id_old;
+    uint64_t             mnt_attr;
+    uint64_t             mnt_propagation;
+    uint64_t             mnt_peer_group;
+    uint64_t             mnt_master;
+    uint64_t             propagate_from;
+    uint32_t             mnt_root;
+    uint32_t             mnt_point;
+    uint64_t             mnt_ns_id;
+    uint32_t             fs_subtype;
+    uint32_t             sb_source;
+    uint64_t             spare2[48];
+    char                 str[];
+} ldm_statmount;
 
 /* Static global structs */
 
 static struct libmnt_table     *g_fstab;
-static struct libmnt_table     *g_mtab;
-static struct device_t         *g_devices[MAX_DEVICES];
+static struct fstab_index_t     g_fstab_index;
+static struct libmnt_cache     *g_fstab_cache;
+static struct htable_t          g_mpnames;
+static struct htable_t          g_interned;
+static struct slab_t            g_device_slab = SLAB_INIT(struct device_t);
+static struct slab_t            g_pending_slab = SLAB_INIT(struct pending_t);
+static struct slab_t            g_debounce_slab = SLAB_INIT(struct debounce_t);
+static struct slab_t            g_job_slab = SLAB_INIT(struct job_t);
+static struct htable_t          g_mpbases;
+static int                      g_fstab_cache_stale;
+static struct mtab_t            g_mtab;
+static struct registry_t        g_devices;
 static FILE                    *g_lockfd;
 static int                      g_running;
 static int                      g_uid;
 static int                      g_gid;
+static int                      g_epollfd = -1;
+/* The batch being dispatched, so that removed sources can be skipped */
+static struct epoll_event      *g_ev_batch;
+static int                      g_ev_batch_len;
+static struct helper_t         *g_helpers_head;
+static struct helper_t         *g_helpers_tail;
+static int                      g_helpers_running;
+static struct coproc_t          g_coproc;
+
+/* Plugins, g_plugins_lock protects the event queue */
+
+static struct plugin_t          g_plugins[MAX_PLUGINS];
+static int                      g_nplugins;
+static pthread_t                g_plugins_thread;
+static pthread_mutex_t          g_plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           g_plugins_cond = PTHREAD_COND_INITIALIZER;
+static struct plugin_event_t   *g_plugins_head;
+static struct plugin_event_t   *g_plugins_tail;
+static int                      g_plugins_quit;
+
+/* Events waiting for their coalescing window to close, oldest first */
+
+static struct htable_t          g_debounce;
+static struct debounce_t       *g_debounce_head;
+static struct debounce_t       *g_debounce_tail;
+static struct ev_timer_t        g_debounce_timer;
+static long                     g_debounce_window = DEBOUNCE_WINDOW;
+
+/* Registry snapshots and the threads serving them, g_status_lock only
+ * protects the request queue */
+
+static struct snapshot_t       *g_snapshot;
+static struct snapshot_t       *g_retired;
+static unsigned long            g_epoch = 1;
+static unsigned long            g_reader_epoch[STATUS_THREADS];
+static pthread_t                g_status_threads[STATUS_THREADS];
+static int                      g_nstatus;
+static pthread_mutex_t          g_status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           g_status_cond = PTHREAD_COND_INITIALIZER;
+static struct status_req_t     *g_status_head;
+static struct status_req_t     *g_status_tail;
+static int                      g_status_quit;
+
+/* Worker pool state, g_jobs_lock protects the two queues */
+
+static pthread_t                g_workers[MAX_WORKERS];
+static int                      g_nworkers;
+static pthread_mutex_t          g_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           g_jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct job_t            *g_jobs_head;
+static struct job_t            *g_jobs_tail;
+static struct job_t            *g_done_head;
+static struct job_t            *g_done_tail;
+static int                      g_jobs_quit;
+static int                      g_jobs_inflight;
+static int                      g_parallel = PARALLEL_JOBS;
+
+/* Devices found at startup and not handed to the workers yet */
+
+static struct props_t         **g_coldplug;
+static size_t                   g_ncoldplug;
+static size_t                   g_coldplug_next;
+static int                      g_no_fsapi;
+/* What's never worth a look, the RAM disks unless told otherwise */
+static struct ignore_t          g_ignore[MAX_IGNORE] = {
+    { IGNORE_NAME, 0, "ram", 3 },
+    { IGNORE_NAME, 0, "zram", 4 },
+    { IGNORE_MAJOR, 1, NULL, 0 },
+};
+static int                      g_nignore = 3;
+static struct uevent_ring_t    *g_uevent_ring;
+static int                      g_raw_uevents;
+static int                      g_rcvbuf = RCVBUF_SIZE;
+static struct ev_timer_t        g_resync_timer;
+static int                      g_resync_pending;
+static int                      g_donefd = -1;
 
 /* Functions declaration */
 char * s_strdup(const char *str);
+void * slab_alloc(struct slab_t *slab);
+void slab_free(struct slab_t *slab, void *obj);
+void slab_destroy(struct slab_t *slab);
+const char * intern(const char *str);
+unsigned long hash_str(const char *str);
+unsigned long hash_num(uint64_t num);
+int htable_init(struct htable_t *t, unsigned long size);
+void htable_free(struct htable_t *t);
+int htable_insert(struct htable_t *t, struct hnode_t *node, const char *key, uint64_t num, void *data);
+void htable_remove(struct htable_t *t, struct hnode_t *node);
+struct hnode_t * htable_lookup(struct htable_t *t, const char *key, uint64_t num);
+void * htable_find(struct htable_t *t, const char *key);
+void * htable_find_num(struct htable_t *t, uint64_t num);
 int lock_create(int pid);
 int lock_remove(void);
 int lock_exist(void);
-struct libmnt_fs * fstab_search (struct libmnt_table *tab, struct udev_device *device);
+int spawn_helper(const char *helper, const char *action, char *mountpoint);
+void helpers_flush(void);
+int coproc_start(void);
+void coproc_send(const char *action, const char *mountpoint);
+void coproc_flush(void);
+void coproc_stop(void);
+int plugin_load(const char *path);
+int plugins_start(void);
+void plugins_send(const char *action, struct device_t *device);
+void plugins_stop(void);
+void registry_publish(void);
+int status_start(void);
+int status_listen(void);
+void status_accept(int fd);
+void status_stop(void);
+int status_query(void);
+void notify_callbacks(const char *action, struct device_t *device);
+int fstab_reload(struct udev *udev);
+void fstab_index_clear(struct fstab_index_t *idx);
+struct fstab_key_t * fstab_lookup(struct fstab_index_t *idx, struct props_t *props);
 int device_has_media(struct device_t *device);
-int filesystem_needs_id_fix(char *fs);
+int device_same_media(struct device_t *device, struct props_t *props);
+struct props_t * props_new(struct udev_device *dev);
+struct props_t * props_ref(struct props_t *props);
+void props_unref(struct props_t *props);
+int mountpoint_scan(void);
+char * mountpoint_reserve(const char *base);
+void mountpoint_release(const char *path, int keep);
+void mountpoint_clear(void);
 char * device_create_mountpoint(struct device_t *device);
+int device_rename_mountpoint(struct device_t *device);
 void device_list_clear(void);
 int device_register(struct device_t *dev);
 void device_destroy(struct device_t *dev);
 struct device_t * device_search(const char *devnode);
-struct device_t * device_new(struct udev_device *dev);
-int device_mount(struct udev_device *dev);
-int device_unmount(struct udev_device *dev);
-int device_change(struct udev_device *dev);
+struct device_t * device_search_devnum(dev_t devnum);
+struct device_t * device_new(struct props_t *props);
+int device_mount(struct props_t *props);
+int device_unmount(struct props_t *props);
+int device_change(struct props_t *props);
+int device_is_mounted(struct props_t *props);
+int device_event(int action, struct props_t *props);
+int event_action(const char *action);
+int64_t now_msec(void);
+int debounce_init(void);
+void debounce_event(int action, struct props_t *props);
+void debounce_clear(void);
+int workers_init(void);
+int workers_submit(struct device_t *device, int type);
+void workers_complete(void);
+void workers_drain(void);
+void workers_stop(void);
 int force_reload_table (struct libmnt_table **table, const char *path);
-void mount_plugged_devices(struct udev *udev);
-void sig_handler(int signal);
+int fifo_open(int oldfd, const int mode);
+int mtab_reload(void);
+int mtab_watch_open(void);
+int mtab_notify_init(void);
+void mtab_notify(void);
+void mtab_self_mount(struct device_t *device, uint64_t id);
+void mtab_self_unmount(struct device_t *device);
+void mtab_clear(void);
+struct mount_t * mtab_find(dev_t devnum, const char *source);
+void mount_plugged_devices(void);
+void coldplug_next(void);
+void coldplug_clear(void);
+int ev_init(void);
+int ev_add(struct ev_source_t *src, int fd, uint32_t events, void (*cb)(struct ev_source_t *, uint32_t), void *data);
+void ev_del(struct ev_source_t *src);
+int ev_timer_init(struct ev_timer_t *timer, void (*cb)(struct ev_timer_t *), void *data);
+int ev_timer_arm(struct ev_timer_t *timer, long msec);
+void ev_timer_free(struct ev_timer_t *timer);
+int ev_run(int timeout);
 int daemonize(void);
 
 /* A less stupid s_strdup */
@@ -92,312 +762,2174 @@ s_strdup(const char *str)
     return (char *)strdup(str);
 }
 
-/* Locking functions */
+/* Hash table. Nodes are embedded in the indexed objects so that insertion
+ * never allocates; the bucket array doubles once the load factor hits 1 */
 
-int
-lock_create (int pid)
+unsigned long
+hash_str (const char *str)
 {
-    g_lockfd = fopen(LOCK_PATH, "w+");
-    if (!g_lockfd)
-        return 0;
-    fprintf(g_lockfd, "%d", pid);
-    fclose(g_lockfd);
-    return 1;
+    unsigned long h = 2166136261UL;
+
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619UL;
+    }
+
+    return h;
 }
 
-int
-lock_remove (void)
+unsigned long
+hash_num (uint64_t num)
 {
-    return (remove(LOCK_PATH) == 0);
+    num ^= num >> 33;
+    num *= UINT64_C(0xff51afd7ed558ccd);
+    num ^= num >> 33;
+
+    return (unsigned long)num;
 }
 
 int
-lock_exist (void)
+htable_init (struct htable_t *t, unsigned long size)
 {
-    return (access(LOCK_PATH, F_OK) != -1);
+    t->count = 0;
+    t->size = (size < HTABLE_MIN_SIZE) ? HTABLE_MIN_SIZE : size;
+    t->buckets = calloc(t->size, sizeof(struct hnode_t *));
+
+    return (t->buckets != NULL);
 }
 
-/* Spawn helper */
+void
+htable_free (struct htable_t *t)
+{
+    free(t->buckets);
+    t->buckets = NULL;
+    t->size = t->count = 0;
+}
 
-int
-spawn_helper (const char *helper, const char *action, char *mountpoint)
+static void
+htable_grow (struct htable_t *t)
 {
-    pid_t child_pid;
-    int ret;
+    struct hnode_t **buckets;
+    struct hnode_t *node, *next;
+    unsigned long size, j;
+
+    size = t->size * 2;
+    buckets = calloc(size, sizeof(struct hnode_t *));
+
+    /* Not fatal, the chains just get longer */
+    if (!buckets)
+        return;
+
+    for (j = 0; j < t->size; j++) {
+        for (node = t->buckets[j]; node; node = next) {
+            next = node->next;
+            node->next = buckets[node->hash & (size - 1)];
+            buckets[node->hash & (size - 1)] = node;
+        }
+    }
 
-    if (!helper)
-        return 0;
+    free(t->buckets);
+    t->buckets = buckets;
+    t->size = size;
+}
 
-    child_pid = fork();
+/* A NULL key means the node is keyed by num */
+int
+htable_insert (struct htable_t *t, struct hnode_t *node, const char *key, uint64_t num, void *data)
+{
+    struct hnode_t **bucket;
 
-    if (child_pid < 0)
+    if (!t->buckets && !htable_init(t, HTABLE_MIN_SIZE))
         return 0;
 
-    if (child_pid > 0) {
-        wait(&ret);
-        /* Return the exit code or 0 if something went wrong */
-        return WIFEXITED(ret) ? WEXITSTATUS(ret) : 0;
-    }
+    if (t->count >= t->size)
+        htable_grow(t);
 
-    /* Drop the root priviledges. Oh and the bass too. */
-    setgid(g_gid);
-    setuid(g_uid);
+    node->key = key;
+    node->num = num;
+    node->data = data;
+    node->hash = (key) ? hash_str(key) : hash_num(num);
 
-    execvp(helper, (char *[]){ (char *)helper, (char *)action, mountpoint, NULL });
-    /* Should never reach this */
-    syslog(LOG_ERR, "Could not execute \"%s\"", helper);
-    /* Die */
-    _Exit(1);
-}
+    bucket = &t->buckets[node->hash & (t->size - 1)];
+    node->next = *bucket;
+    *bucket = node;
+    t->count++;
 
-/* Convenience function for fstab handling */
+    return 1;
+}
 
-struct libmnt_fs *
-fstab_search (struct libmnt_table *tab, struct udev_device *udev)
+void
+htable_remove (struct htable_t *t, struct hnode_t *node)
 {
-    struct libmnt_fs *ret;
-    const char *tmp;
+    struct hnode_t **p;
 
-    /* Try matching the /dev node */
-    tmp = udev_device_get_devnode(udev);
-    /* Is it a logical volume */
-    if (strncmp(tmp, "/dev/dm-", 8)) {
-        ret = mnt_table_find_source(tab, tmp, MNT_ITER_FORWARD);
-        if (ret) 
-            return ret;
-    } else {
-        struct udev_list_entry *list_entry;
-        
-        /* Walk all the symbolic links pointing to this volume */
-        udev_list_entry_foreach(list_entry, udev_device_get_devlinks_list_entry(udev)) {
-            ret = mnt_table_find_source(tab, udev_list_entry_get_name(list_entry), MNT_ITER_FORWARD);
-            if (ret) 
-                return ret;
+    if (!t->buckets)
+        return;
+
+    for (p = &t->buckets[node->hash & (t->size - 1)]; *p; p = &(*p)->next) {
+        if (*p == node) {
+            *p = node->next;
+            node->next = NULL;
+            t->count--;
+            return;
         }
     }
+}
 
-    /* Try matching the uuid */
-    tmp = udev_device_get_property_value(udev, "ID_FS_UUID");
-    if (!tmp)
-        return NULL;
-    ret = mnt_table_find_source(tab, tmp, MNT_ITER_FORWARD);
-    if (ret) 
-        return ret;
+struct hnode_t *
+htable_lookup (struct htable_t *t, const char *key, uint64_t num)
+{
+    struct hnode_t *node;
+    unsigned long h;
 
-    /* Try matching the label */
-    tmp = udev_device_get_property_value(udev, "ID_FS_LABEL");
-    if (!tmp)
+    if (!t->buckets)
         return NULL;
-    ret = mnt_table_find_source(tab, tmp, MNT_ITER_FORWARD);
-    if (ret) 
-        return ret;
+
+    h = (key) ? hash_str(key) : hash_num(num);
+
+    for (node = t->buckets[h & (t->size - 1)]; node; node = node->next) {
+        if (node->hash != h)
+            continue;
+        if (key ? (node->key && !strcmp(node->key, key)) : (!node->key && node->num == num))
+            return node;
+    }
 
     return NULL;
 }
 
-int
-fstab_has_option (struct libmnt_table *tab, struct udev_device *udev, const char *option)
+void *
+htable_find (struct htable_t *t, const char *key)
 {
-    struct libmnt_fs *ret;
+    struct hnode_t *node;
 
-    ret = fstab_search(tab, udev);
-    if (!ret)
-        return 0;
+    if (!key)
+        return NULL;
+    node = htable_lookup(t, key, 0);
+    return (node) ? node->data : NULL;
+}
 
-    return mnt_fs_match_options(ret, option);
+void *
+htable_find_num (struct htable_t *t, uint64_t num)
+{
+    struct hnode_t *node;
+
+    node = htable_lookup(t, NULL, num);
+    return (node) ? node->data : NULL;
 }
 
-int 
-device_has_media (struct device_t *device) 
+static void
+htable_free_all (struct htable_t *t)
 {
-    if (!device)
-        return 0;
-    switch (device->type) {
-        case DEVICE_VOLUME:
-            return (udev_device_get_property_value(device->udev, "ID_FS_USAGE") != NULL);
-        case DEVICE_CD:
-            return (udev_device_get_property_value(device->udev, "ID_CDROM_MEDIA") != NULL);
-	default:
-	    return 0;
+    struct hnode_t *node, *next;
+    unsigned long j;
+
+    for (j = 0; j < t->size; j++) {
+        for (node = t->buckets[j]; node; node = next) {
+            next = node->next;
+            free(node->data);
+        }
     }
+
+    htable_free(t);
 }
 
-int
-filesystem_quirks (char *fs)
+/* Slabs of fixed size objects. Memory is grabbed SLAB_CHUNK objects at a
+ * time and the freed objects are kept around for the next allocation, so
+ * the hotplug churn doesn't hit malloc at all once warmed up. Main thread
+ * only */
+
+void *
+slab_alloc (struct slab_t *slab)
 {
-    int i;
-    static const fs_quirk_t fs_table [] = {
-        { "msdos" , QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
-        { "umsdos", QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
-        { "vfat",   QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
-        { "exfat",  QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
-        { "ntfs",   QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
-        { "iso9660",QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
-        { "udf",    QUIRK_OWNER_FIX },
-    };
+    char *chunk;
+    void *obj;
+    int j;
 
-    for (i = 0; i < sizeof(fs_table)/sizeof(fs_quirk_t); i++) {
-        if (!strcmp(fs_table[i].name, fs))
-            return fs_table[i].quirks;
+    if (!slab->free) {
+        chunk = malloc(SLAB_ALIGN + slab->size * SLAB_CHUNK);
+        if (!chunk)
+            return NULL;
+
+        *(void **)chunk = slab->chunks;
+        slab->chunks = chunk;
+
+        for (j = SLAB_CHUNK - 1; j >= 0; j--) {
+            obj = chunk + SLAB_ALIGN + (size_t)j * slab->size;
+            *(void **)obj = slab->free;
+            slab->free = obj;
+        }
     }
-    return QUIRK_NONE;    
+
+    obj = slab->free;
+    slab->free = *(void **)obj;
+
+    return memset(obj, 0, slab->size);
 }
 
-char *
-device_create_mountpoint (struct device_t *device)
+void
+slab_free (struct slab_t *slab, void *obj)
 {
-    char tmp[PATH_MAX];
-    char *c;
-    const char *label, *uuid, *serial;
-    struct stat st;
+    if (!obj)
+        return;
 
-    label = udev_device_get_property_value(device->udev, "ID_FS_LABEL");
-    uuid = udev_device_get_property_value(device->udev, "ID_FS_UUID");
-    serial = udev_device_get_property_value(device->udev, "ID_SERIAL");
+    *(void **)obj = slab->free;
+    slab->free = obj;
+}
 
-    if (label)
-        snprintf(tmp, sizeof(tmp), "%s%s", MOUNT_PATH, label);
-    else if (uuid)
-        snprintf(tmp, sizeof(tmp), "%s%s", MOUNT_PATH, uuid);
-    else if (serial)
-        snprintf(tmp, sizeof(tmp), "%s%s", MOUNT_PATH, serial);
-    else
-        return NULL;
+void
+slab_destroy (struct slab_t *slab)
+{
+    void *chunk;
 
-    /* Replace the whitespaces */
-    for (c = tmp; *c; c++) {
-       if (*c == ' ')
-           *c = '_';
+    while ((chunk = slab->chunks)) {
+        slab->chunks = *(void **)chunk;
+        free(chunk);
     }
 
-    /* Check if there's another folder with the same name */
-    while (!stat(tmp, &st)) {
-        /* We tried hard and failed */
-        if (strlen(tmp) == sizeof(tmp) - 2) 
-            return NULL;
-        /* Append a trailing _ */
-        strcat(tmp, "_");
-    }
+    slab->free = NULL;
+}
+
+/* The handful of strings every device repeats (filesystem and device
+ * types) are stored once and never freed until exit */
+
+typedef struct istr_t {
+    struct hnode_t       node;
+    char                 str[];
+} istr_t;
+
+const char *
+intern (const char *str)
+{
+    struct istr_t *s;
+    size_t len;
+
+    if (!str)
+        return NULL;
+
+    s = htable_find(&g_interned, str);
+    if (s)
+        return s->str;
+
+    len = strlen(str) + 1;
+    s = malloc(sizeof(struct istr_t) + len);
+    if (!s)
+        return NULL;
 
-    return s_strdup(tmp);
+    memcpy(s->str, str, len);
+    htable_insert(&g_interned, &s->node, s->str, 0, s);
+
+    return s->str;
 }
 
-void 
-device_list_clear (void)
+/* Event loop. Every source is registered edge-triggered so its callback
+ * must drain the fd until EAGAIN */
+
+int
+ev_init (void)
 {
-    int j;
+    g_epollfd = epoll_create1(EPOLL_CLOEXEC);
 
-    for (j = 0; j < MAX_DEVICES; j++) {
-        if (g_devices[j])
-            device_unmount(g_devices[j]->udev);
-        g_devices[j] = NULL;
-    }
+    return (g_epollfd >= 0);
 }
 
 int
-device_register (struct device_t *dev)
+ev_add (struct ev_source_t *src, int fd, uint32_t events, void (*cb)(struct ev_source_t *, uint32_t), void *data)
 {
-    int j;
+    struct epoll_event ev;
 
-    for (j = 0; j < MAX_DEVICES; j++) {
-        if (g_devices[j] == NULL) {
-            g_devices[j] = dev;
-            return 1;
-        }
+    src->fd = fd;
+    src->cb = cb;
+    src->data = data;
+
+    ev.events = events | EPOLLET;
+    ev.data.ptr = src;
+
+    if (epoll_ctl(g_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        syslog(LOG_ERR, "Cannot watch fd %d (%s)", fd, strerror(errno));
+        src->fd = -1;
+        return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 void
-device_destroy (struct device_t *dev)
+ev_del (struct ev_source_t *src)
 {
     int j;
 
-    for (j = 0; j < MAX_DEVICES; j++) {
-        if (g_devices[j] == dev)
-            break;
+    if (src->fd < 0)
+        return;
+
+    epoll_ctl(g_epollfd, EPOLL_CTL_DEL, src->fd, NULL);
+    src->fd = -1;
+
+    /* The source may be freed as soon as we return, forget about the
+     * events it still has waiting in this batch */
+    for (j = 0; j < g_ev_batch_len; j++) {
+        if (g_ev_batch[j].data.ptr == src)
+            g_ev_batch[j].data.ptr = NULL;
     }
+}
 
-    free(dev->devnode);
-    free(dev->filesystem);
-    free(dev->mountpoint);
-    udev_device_unref(dev->udev);
+static void
+ev_timer_fire (struct ev_source_t *src, uint32_t events)
+{
+    struct ev_timer_t *timer = src->data;
+    uint64_t expirations;
 
-    free(dev);
+    (void)events;
 
-    /* Might happen that we have to destroy a device not yet
-     * registered. Just free it */
-    if (j < MAX_DEVICES)
-        g_devices[j] = NULL;
+    if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    timer->cb(timer);
 }
 
-/* Path is either the /dev/ node or the mountpoint */
-struct device_t *
-device_search (const char *path)
+int
+ev_timer_init (struct ev_timer_t *timer, void (*cb)(struct ev_timer_t *), void *data)
 {
-    int j;
+    int fd;
 
-    if (!path)
-        return NULL;
+    timer->cb = cb;
+    timer->data = data;
+    timer->src.fd = -1;
 
-    for (j = 0; j < MAX_DEVICES; j++) {
-        if (g_devices[j]) {
-            if (!strcmp(g_devices[j]->devnode, path) || !strcmp(g_devices[j]->mountpoint, path))
-                return g_devices[j];
-        }
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+        return 0;
+
+    if (!ev_add(&timer->src, fd, EPOLLIN, ev_timer_fire, timer)) {
+        close(fd);
+        return 0;
     }
 
-    return NULL;
+    return 1;
 }
 
+/* One-shot, a zero timeout disarms the timer */
 int
-device_is_mounted (struct udev_device *dev)
+ev_timer_arm (struct ev_timer_t *timer, long msec)
 {
-    /* Use fstab_search to resolve lvm names */
-    return (fstab_search(g_mtab, dev) != NULL);
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = msec / 1000;
+    its.it_value.tv_nsec = (msec % 1000) * 1000000L;
+
+    return (timerfd_settime(timer->src.fd, 0, &its, NULL) == 0);
 }
 
-struct device_t *
-device_new (struct udev_device *dev)
+void
+ev_timer_free (struct ev_timer_t *timer)
 {
-    struct device_t *device;
-    struct libmnt_fs *fstab_entry;
+    int fd = timer->src.fd;
 
-    const char *dev_type;
-    const char *dev_idtype;
-   
-    /* First of all check wether we're dealing with a noauto device */
-    if (fstab_has_option(g_fstab, dev, "+noauto")) 
-        return NULL;
+    if (fd < 0)
+        return;
 
-    device = calloc(1, sizeof(struct device_t));
+    ev_del(&timer->src);
+    close(fd);
+}
 
-    if (!device)
-        return NULL;
+/* Wait for a batch of events and dispatch them */
+int
+ev_run (int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct ev_source_t *src;
+    int j, n;
 
-    device->udev = dev;
-    udev_device_ref(device->udev);
+    n = epoll_wait(g_epollfd, events, MAX_EVENTS, timeout);
 
-    device->devnode = s_strdup(udev_device_get_devnode(dev));
-    device->filesystem = s_strdup(udev_device_get_property_value(dev, "ID_FS_TYPE"));
+    if (n < 0)
+        return (errno == EINTR);
 
-    dev_type    = udev_device_get_devtype(dev);
-    dev_idtype  = udev_device_get_property_value(dev, "ID_TYPE");
+    g_ev_batch = events;
+    g_ev_batch_len = n;
 
-    device->type = DEVICE_UNK;
+    for (j = 0; j < n; j++) {
+        src = events[j].data.ptr;
+        if (src)
+            src->cb(src, events[j].events);
+    }
 
-    /* Avoid mounting swap partitions because we're not intrested in those and LVM/LUKS 
-     * containers as udev issues another event for each single partition contained in them */
-    if (!device->filesystem || 
-        !strcmp(device->filesystem, "swap") || 
-        !strcmp(device->filesystem, "LVM2_member") || 
-        !strcmp(device->filesystem, "crypto_LUKS")) { 
-        device_destroy(device);
-        return NULL;
+    g_ev_batch = NULL;
+    g_ev_batch_len = 0;
+
+    return 1;
+}
+
+/* Locking functions */
+
+int
+lock_create (int pid)
+{
+    g_lockfd = fopen(LOCK_PATH, "w+");
+    if (!g_lockfd)
+        return 0;
+    fprintf(g_lockfd, "%d", pid);
+    fclose(g_lockfd);
+    return 1;
+}
+
+int
+lock_remove (void)
+{
+    return (remove(LOCK_PATH) == 0);
+}
+
+int
+lock_exist (void)
+{
+    return (access(LOCK_PATH, F_OK) != -1);
+}
+
+/* Spawn helper. The helpers run in the background, tracked by a pidfd, and
+ * at most MAX_HELPERS of them at a time; the others wait in a queue */
+
+static void
+helper_free (struct helper_t *helper)
+{
+    free(helper->path);
+    free(helper->action);
+    free(helper->mountpoint);
+    free(helper);
+}
+
+static pid_t
+helper_exec (const char *path, const char *action, const char *mountpoint, int infd)
+{
+    char *argv[] = { (char *)path, (char *)action, (char *)mountpoint, NULL };
+    sigset_t empty;
+    pid_t pid;
+
+    sigemptyset(&empty);
+
+    pid = vfork();
+
+    if (pid != 0)
+        return pid;
+
+    /* We're sharing the memory with the parent, raw syscalls only. Drop the 
+     * root priviledges. Oh and the bass too. */
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    if (syscall(SYS_setgid, g_gid) < 0 || syscall(SYS_setuid, g_uid) < 0)
+        _exit(126);
+
+    if (infd == 0)
+        fcntl(0, F_SETFD, 0);
+    else if (infd > 0 && dup2(infd, 0) < 0)
+        _exit(126);
+
+    execvp(path, argv);
+    /* Die */
+    _exit(127);
+}
+
+static void helper_start (struct helper_t *helper);
+
+static void
+helper_done (struct helper_t *helper)
+{
+    int pidfd = helper->src.fd;
+
+    ev_timer_free(&helper->timer);
+    if (pidfd >= 0) {
+        ev_del(&helper->src);
+        close(pidfd);
     }
+    helper_free(helper);
 
-    if (!strcmp(dev_type,   "partition")|| 
+    g_helpers_running--;
+
+    /* Make room for the next one */
+    if (g_helpers_head) {
+        helper = g_helpers_head;
+        g_helpers_head = helper->next;
+        if (!g_helpers_head)
+            g_helpers_tail = NULL;
+        helper_start(helper);
+    }
+}
+
+/* Returns 1 if the helper is gone, and so is the struct */
+static int
+helper_reap (struct helper_t *helper)
+{
+    int status;
+
+    if (waitpid(helper->pid, &status, WNOHANG) <= 0)
+        return 0;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+        syslog(LOG_ERR, "Could not execute \"%s\"", helper->path);
+
+    helper_done(helper);
+
+    return 1;
+}
+
+static void
+on_helper_exit (struct ev_source_t *src, uint32_t events)
+{
+    (void)events;
+
+    helper_reap(src->data);
+}
+
+static void
+on_helper_timeout (struct ev_timer_t *timer)
+{
+    struct helper_t *helper = timer->data;
+
+    /* Without a pidfd it's up to the timer to notice it's gone */
+    if (helper->src.fd < 0 && helper_reap(helper))
+        return;
+
+    if (!helper->killed && now_msec() >= helper->deadline) {
+        syslog(LOG_WARNING, "\"%s\" is taking too long, killing it", helper->path);
+        /* The pidfd becomes readable once it's dead */
+        kill(helper->pid, SIGKILL);
+        helper->killed = 1;
+    }
+
+    if (helper->src.fd < 0)
+        ev_timer_arm(&helper->timer, HELPER_POLL);
+}
+
+static void
+helper_start (struct helper_t *helper)
+{
+    int pidfd;
+    int status;
+
+    helper->src.fd = -1;
+    helper->timer.src.fd = -1;
+
+    g_helpers_running++;
+
+    helper->pid = helper_exec(helper->path, helper->action, helper->mountpoint, -1);
+
+    if (helper->pid < 0) {
+        syslog(LOG_ERR, "Could not spawn \"%s\" (%s)", helper->path, strerror(errno));
+        helper_done(helper);
+        return;
+    }
+
+    pidfd = (int)syscall(SYS_pidfd_open, helper->pid, 0);
+
+    if (pidfd >= 0 && !ev_add(&helper->src, pidfd, EPOLLIN, on_helper_exit, helper))
+        close(pidfd);
+
+    helper->deadline = now_msec() + HELPER_TIMEOUT;
+
+    if (!ev_timer_init(&helper->timer, on_helper_timeout, helper)) {
+        syslog(LOG_ERR, "Cannot set a timeout for \"%s\", killing it", helper->path);
+        kill(helper->pid, SIGKILL);
+        helper->killed = 1;
+        /* Nothing's going to tell us when it's gone, it won't take long */
+        if (helper->src.fd < 0) {
+            waitpid(helper->pid, &status, 0);
+            helper_done(helper);
+        }
+        return;
+    }
+
+    /* Pre 5.3 kernel or no room for the pidfd, check on it every now and then */
+    ev_timer_arm(&helper->timer, (helper->src.fd < 0) ? HELPER_POLL : HELPER_TIMEOUT);
+}
+
+int
+spawn_helper (const char *helper, const char *action, char *mountpoint)
+{
+    struct helper_t *h;
+
+    if (!helper)
+        return 0;
+
+    h = calloc(1, sizeof(struct helper_t));
+
+    if (!h)
+        return 0;
+
+    h->path = s_strdup(helper);
+    h->action = s_strdup(action);
+    h->mountpoint = s_strdup(mountpoint);
+
+    if (!h->path || !h->action || !h->mountpoint) {
+        helper_free(h);
+        return 0;
+    }
+
+    if (g_helpers_running >= MAX_HELPERS) {
+        if (g_helpers_tail)
+            g_helpers_tail->next = h;
+        else
+            g_helpers_head = h;
+        g_helpers_tail = h;
+        return 1;
+    }
+
+    helper_start(h);
+
+    return 1;
+}
+
+/* Shutting down, fire off whatever is still queued and forget about it */
+void
+helpers_flush (void)
+{
+    struct helper_t *helper, *next;
+
+    for (helper = g_helpers_head; helper; helper = next) {
+        next = helper->next;
+        helper_exec(helper->path, helper->action, helper->mountpoint, -1);
+        helper_free(helper);
+    }
+
+    g_helpers_head = g_helpers_tail = NULL;
+}
+
+/* Persistent helper. Every mount/unmount is sent to its stdin as a single 
+ * "<action> <mountpoint>" record terminated by a NUL byte; the records are 
+ * buffered and written once per loop iteration so that a burst of events 
+ * costs a single write */
+
+static void
+coproc_close (void)
+{
+    if (g_coproc.out_src.fd >= 0)
+        ev_del(&g_coproc.out_src);
+    if (g_coproc.exit_src.fd >= 0) {
+        ev_del(&g_coproc.exit_src);
+        close(g_coproc.exit_src.fd);
+    }
+    if (g_coproc.fd >= 0)
+        close(g_coproc.fd);
+
+    g_coproc.fd = g_coproc.exit_src.fd = g_coproc.out_src.fd = -1;
+    g_coproc.pid = -1;
+}
+
+static void
+on_coproc_exit (struct ev_source_t *src, uint32_t events)
+{
+    int status;
+
+    (void)src;
+    (void)events;
+
+    if (waitpid(g_coproc.pid, &status, WNOHANG) <= 0)
+        return;
+
+    syslog(LOG_WARNING, "\"%s\" died, restarting it", g_coproc.path);
+
+    coproc_close();
+
+    /* Don't hand the new instance the tail of a record */
+    if (g_coproc.midrecord) {
+        char *end = memchr(g_coproc.buf, '\0', g_coproc.len);
+        size_t skip = (end) ? (size_t)(end - g_coproc.buf) + 1 : g_coproc.len;
+
+        memmove(g_coproc.buf, g_coproc.buf + skip, g_coproc.len - skip);
+        g_coproc.len -= skip;
+        g_coproc.midrecord = 0;
+    }
+
+    ev_timer_arm(&g_coproc.restart, COPROC_RESTART);
+}
+
+static void
+on_coproc_writable (struct ev_source_t *src, uint32_t events)
+{
+    (void)src;
+    (void)events;
+
+    coproc_flush();
+}
+
+static void
+on_coproc_restart (struct ev_timer_t *timer)
+{
+    (void)timer;
+
+    if (coproc_start())
+        coproc_flush();
+    else
+        ev_timer_arm(&g_coproc.restart, COPROC_RESTART);
+}
+
+int
+coproc_start (void)
+{
+    int fds[2];
+    int pidfd;
+
+    g_coproc.path = COPROC_PATH;
+
+    if (!g_coproc.path)
+        return 0;
+
+    if (!g_coproc.buf && !(g_coproc.buf = malloc(COPROC_BUF_SIZE)))
+        return 0;
+
+    if (g_coproc.restart.src.fd < 0 && !ev_timer_init(&g_coproc.restart, on_coproc_restart, NULL))
+        return 0;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return 0;
+
+    g_coproc.pid = helper_exec(g_coproc.path, NULL, NULL, fds[0]);
+    close(fds[0]);
+
+    if (g_coproc.pid < 0) {
+        syslog(LOG_ERR, "Could not spawn \"%s\" (%s)", g_coproc.path, strerror(errno));
+        close(fds[1]);
+        return 0;
+    }
+
+    g_coproc.fd = fds[1];
+    fcntl(g_coproc.fd, F_SETFL, O_NONBLOCK);
+
+    pidfd = (int)syscall(SYS_pidfd_open, g_coproc.pid, 0);
+
+    if (pidfd < 0 || 
+        !ev_add(&g_coproc.exit_src, pidfd, EPOLLIN, on_coproc_exit, NULL) ||
+        !ev_add(&g_coproc.out_src, g_coproc.fd, EPOLLOUT, on_coproc_writable, NULL)) {
+        syslog(LOG_ERR, "Cannot keep track of \"%s\"", g_coproc.path);
+        if (pidfd >= 0 && g_coproc.exit_src.fd < 0)
+            close(pidfd);
+        kill(g_coproc.pid, SIGKILL);
+        waitpid(g_coproc.pid, NULL, 0);
+        coproc_close();
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+coproc_send (const char *action, const char *mountpoint)
+{
+    size_t len;
+
+    if (!g_coproc.buf)
+        return;
+
+    len = strlen(action) + strlen(mountpoint) + 2;
+
+    /* It isn't keeping up, not much we can do */
+    if (g_coproc.len + len > COPROC_BUF_SIZE) {
+        syslog(LOG_WARNING, "\"%s\" isn't keeping up, dropping an event", g_coproc.path);
+        return;
+    }
+
+    sprintf(g_coproc.buf + g_coproc.len, "%s %s", action, mountpoint);
+    g_coproc.len += len;
+}
+
+void
+coproc_flush (void)
+{
+    ssize_t n;
+
+    if (g_coproc.fd < 0 || !g_coproc.len)
+        return;
+
+    n = write(g_coproc.fd, g_coproc.buf, g_coproc.len);
+
+    /* Try again once the pipe is writable or the helper is back */
+    if (n <= 0)
+        return;
+
+    g_coproc.midrecord = (g_coproc.buf[n - 1] != '\0');
+    memmove(g_coproc.buf, g_coproc.buf + n, g_coproc.len - (size_t)n);
+    g_coproc.len -= (size_t)n;
+}
+
+/* Closing the pipe is the signal to quit */
+void
+coproc_stop (void)
+{
+    coproc_flush();
+    coproc_close();
+    ev_timer_free(&g_coproc.restart);
+    free(g_coproc.buf);
+    g_coproc.buf = NULL;
+}
+
+/* In-process plugins, see ldm_plugin.h */
+
+int
+plugin_load (const char *path)
+{
+    struct plugin_t *plugin;
+    int (*init)(void);
+
+    if (g_nplugins >= MAX_PLUGINS) {
+        syslog(LOG_ERR, "Too many plugins, skipping \"%s\"", path);
+        return 0;
+    }
+
+    plugin = &g_plugins[g_nplugins];
+    plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if (!plugin->handle) {
+        syslog(LOG_ERR, "Cannot load \"%s\" (%s)", path, dlerror());
+        return 0;
+    }
+
+    *(void **)&init = dlsym(plugin->handle, "ldm_plugin_init");
+    *(void **)&plugin->fini = dlsym(plugin->handle, "ldm_plugin_fini");
+    *(void **)&plugin->on_mount = dlsym(plugin->handle, "on_mount");
+    *(void **)&plugin->on_unmount = dlsym(plugin->handle, "on_unmount");
+
+    if (init && init()) {
+        syslog(LOG_ERR, "\"%s\" refused to load", path);
+        dlclose(plugin->handle);
+        return 0;
+    }
+
+    g_nplugins++;
+
+    return 1;
+}
+
+static void *
+plugins_main (void *arg)
+{
+    struct plugin_event_t *event;
+    int j;
+
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&g_plugins_lock);
+        while (!g_plugins_head && !g_plugins_quit)
+            pthread_cond_wait(&g_plugins_cond, &g_plugins_lock);
+        event = g_plugins_head;
+        if (!event) {
+            pthread_mutex_unlock(&g_plugins_lock);
+            break;
+        }
+        g_plugins_head = event->next;
+        if (!g_plugins_head)
+            g_plugins_tail = NULL;
+        pthread_mutex_unlock(&g_plugins_lock);
+
+        for (j = 0; j < g_nplugins; j++) {
+            if (!strcmp(event->ev.action, "mount") && g_plugins[j].on_mount)
+                g_plugins[j].on_mount(&event->ev);
+            else if (!strcmp(event->ev.action, "unmount") && g_plugins[j].on_unmount)
+                g_plugins[j].on_unmount(&event->ev);
+        }
+
+        free(event);
+    }
+
+    return NULL;
+}
+
+int
+plugins_start (void)
+{
+    if (!g_nplugins)
+        return 1;
+
+    if (pthread_create(&g_plugins_thread, NULL, plugins_main, NULL)) {
+        syslog(LOG_ERR, "Cannot spawn the plugin thread");
+        while (g_nplugins > 0)
+            dlclose(g_plugins[--g_nplugins].handle);
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+plugins_send (const char *action, struct device_t *device)
+{
+    struct plugin_event_t *event;
+    const char *fs;
+    size_t len[4];
+    char *p;
+
+    if (!g_nplugins)
+        return;
+
+    fs = (device->filesystem) ? device->filesystem : "";
+
+    len[0] = strlen(action) + 1;
+    len[1] = strlen(device->devnode) + 1;
+    len[2] = strlen(device->mountpoint) + 1;
+    len[3] = strlen(fs) + 1;
+
+    event = malloc(sizeof(struct plugin_event_t) + len[0] + len[1] + len[2] + len[3]);
+
+    if (!event)
+        return;
+
+    p = event->data;
+    event->ev.abi = LDM_PLUGIN_ABI;
+    event->ev.action = memcpy(p, action, len[0]);
+    p += len[0];
+    event->ev.devnode = memcpy(p, device->devnode, len[1]);
+    p += len[1];
+    event->ev.mountpoint = memcpy(p, device->mountpoint, len[2]);
+    p += len[2];
+    event->ev.filesystem = memcpy(p, fs, len[3]);
+    event->next = NULL;
+
+    pthread_mutex_lock(&g_plugins_lock);
+    if (g_plugins_tail)
+        g_plugins_tail->next = event;
+    else
+        g_plugins_head = event;
+    g_plugins_tail = event;
+    pthread_cond_signal(&g_plugins_cond);
+    pthread_mutex_unlock(&g_plugins_lock);
+}
+
+/* Deliver what's left in the queue, then unload everything */
+void
+plugins_stop (void)
+{
+    int j;
+
+    if (!g_nplugins)
+        return;
+
+    pthread_mutex_lock(&g_plugins_lock);
+    g_plugins_quit = 1;
+    pthread_cond_broadcast(&g_plugins_cond);
+    pthread_mutex_unlock(&g_plugins_lock);
+
+    pthread_join(g_plugins_thread, NULL);
+
+    for (j = 0; j < g_nplugins; j++) {
+        if (g_plugins[j].fini)
+            g_plugins[j].fini();
+        dlclose(g_plugins[j].handle);
+    }
+
+    g_nplugins = 0;
+}
+
+void
+notify_callbacks (const char *action, struct device_t *device)
+{
+    spawn_helper(CALLBACK_PATH, action, device->mountpoint);
+    coproc_send(action, device->mountpoint);
+    plugins_send(action, device);
+}
+
+/* Convenience functions for fstab handling. The table is turned into a hash
+ * index after each load so that finding the entry for a device doesn't walk
+ * it over and over */
+
+static int
+fstab_index_add (struct fstab_index_t *idx, const char *key, struct libmnt_fs *fs)
+{
+    struct fstab_key_t *entry;
+    const char *target, *options;
+    size_t key_len, target_len, options_len;
+
+    target = mnt_fs_get_target(fs);
+    if (!key || !target || htable_find(&idx->keys, key))
+        return 1;
+
+    options = mnt_fs_get_options(fs);
+
+    key_len = strlen(key) + 1;
+    target_len = strlen(target) + 1;
+    options_len = (options) ? strlen(options) + 1 : 0;
+
+    entry = malloc(sizeof(struct fstab_key_t) + key_len + target_len + options_len);
+    if (!entry)
+        return 0;
+
+    entry->noauto = (mnt_fs_match_options(fs, "+noauto") == 1);
+    entry->target = memcpy(entry->data + key_len, target, target_len);
+    entry->options = (options) ? memcpy(entry->data + key_len + target_len, options, options_len) : NULL;
+    memcpy(entry->data, key, key_len);
+
+    htable_insert(&idx->keys, &entry->node, entry->data, 0, entry);
+
+    entry->next = idx->head;
+    idx->head = entry;
+
+    return 1;
+}
+
+static int
+fstab_index_build (struct fstab_index_t *idx, struct libmnt_table *tab)
+{
+    struct libmnt_iter *iter;
+    struct libmnt_fs *fs;
+    const char *name, *value;
+    char key[PATH_MAX];
+    int ret = 1;
+
+    iter = mnt_new_iter(MNT_ITER_FORWARD);
+    if (!iter)
+        return 0;
+
+    while (ret && !mnt_table_next_fs(tab, iter, &fs)) {
+        if (!mnt_fs_get_tag(fs, &name, &value)) {
+            if (snprintf(key, sizeof(key), "%s=%s", name, value) >= (int)sizeof(key))
+                continue;
+            ret = fstab_index_add(idx, key, fs);
+        } else {
+            ret = fstab_index_add(idx, mnt_fs_get_srcpath(fs), fs);
+        }
+    }
+
+    mnt_free_iter(iter);
+
+    return ret;
+}
+
+void
+fstab_index_clear (struct fstab_index_t *idx)
+{
+    struct fstab_key_t *entry;
+
+    while ((entry = idx->head)) {
+        idx->head = entry->next;
+        free(entry);
+    }
+
+    htable_free(&idx->keys);
+}
+
+static struct fstab_key_t *
+fstab_lookup_tag (struct fstab_index_t *idx, const char *name, const char *value)
+{
+    char key[PATH_MAX];
+
+    if (!value || snprintf(key, sizeof(key), "%s=%s", name, value) >= (int)sizeof(key))
+        return NULL;
+
+    return htable_find(&idx->keys, key);
+}
+
+/* Look the device up by its /dev node, its symlinks and its tags, in this
+ * order. Done once per event, the result carries both the noauto decision
+ * and the target */
+struct fstab_key_t *
+fstab_lookup (struct fstab_index_t *idx, struct props_t *props)
+{
+    struct fstab_key_t *ret;
+    int j;
+
+    /* Logical volumes get a different dm-N node every time */
+    if (props->devnode && strncmp(props->devnode, "/dev/dm-", 8)) {
+        ret = htable_find(&idx->keys, props->devnode);
+        if (ret)
+            return ret;
+    }
+
+    for (j = 0; j < props->ndevlinks; j++) {
+        ret = htable_find(&idx->keys, props->devlinks[j]);
+        if (ret)
+            return ret;
+    }
+
+    if ((ret = fstab_lookup_tag(idx, "UUID", props->fs_uuid)))
+        return ret;
+    if ((ret = fstab_lookup_tag(idx, "PARTUUID", props->part_uuid)))
+        return ret;
+
+    return fstab_lookup_tag(idx, "LABEL", props->fs_label);
+}
+
+static int
+fstab_key_same (struct fstab_key_t *a, struct fstab_key_t *b)
+{
+    if (!a || !b)
+        return (a == b);
+
+    return (a->noauto == b->noauto && 
+            !strcmp(a->target, b->target) && 
+            ((!a->options && !b->options) || (a->options && b->options && !strcmp(a->options, b->options))));
+}
+
+/* The tag and path resolutions are cached by libmount, the cache goes
+ * stale as soon as udev tells us something changed and is rebuilt the
+ * next time it's needed */
+static struct libmnt_cache *
+fstab_cache (void)
+{
+    if (g_fstab_cache && g_fstab_cache_stale) {
+        mnt_unref_cache(g_fstab_cache);
+        g_fstab_cache = NULL;
+    }
+
+    if (!g_fstab_cache) {
+        g_fstab_cache = mnt_new_cache();
+        if (g_fstab_cache && g_fstab)
+            mnt_table_set_cache(g_fstab, g_fstab_cache);
+    }
+
+    g_fstab_cache_stale = 0;
+
+    return g_fstab_cache;
+}
+
+/* Find the block device a changed key refers to, if it's around */
+static int
+fstab_key_devnum (const char *key, dev_t *devnum)
+{
+    struct libmnt_cache *cache;
+    struct stat st;
+    char *path;
+    int ret;
+
+    cache = fstab_cache();
+
+    path = mnt_resolve_spec(key, cache);
+    if (!path)
+        return 0;
+
+    ret = (!stat(path, &st) && S_ISBLK(st.st_mode));
+    if (ret)
+        *devnum = st.st_rdev;
+
+    /* Owned by the cache otherwise */
+    if (!cache)
+        free(path);
+
+    return ret;
+}
+
+static int
+fstab_collect (dev_t **devnums, size_t *count, size_t *size, const char *key)
+{
+    dev_t devnum, *tmp;
+    size_t j;
+
+    if (!fstab_key_devnum(key, &devnum))
+        return 1;
+
+    for (j = 0; j < *count; j++) {
+        if ((*devnums)[j] == devnum)
+            return 1;
+    }
+
+    if (*count == *size) {
+        tmp = realloc(*devnums, (*size + 16) * sizeof(dev_t));
+        if (!tmp)
+            return 0;
+        *devnums = tmp;
+        *size += 16;
+    }
+
+    (*devnums)[(*count)++] = devnum;
+
+    return 1;
+}
+
+/* Load the table again and re-evaluate the devices whose entry changed. A
+ * device is found through the keys that differ between the two indexes, and
+ * only acted upon if the entry it resolves to really changed. The ones we
+ * manage are unmounted and handed back to device_new, the ones we skipped
+ * get another chance */
+int
+fstab_reload (struct udev *udev)
+{
+    struct fstab_index_t old;
+    struct fstab_key_t *entry;
+    struct props_t **affected;
+    struct props_t *props;
+    struct udev_device *dev;
+    struct device_t *device;
+    dev_t *devnums = NULL;
+    size_t count = 0, size = 0, naffected = 0, j;
+
+    if (!force_reload_table(&g_fstab, FSTAB_PATH))
+        return 0;
+
+    if (g_fstab_cache)
+        mnt_table_set_cache(g_fstab, g_fstab_cache);
+
+    old = g_fstab_index;
+    memset(&g_fstab_index, 0, sizeof(struct fstab_index_t));
+
+    if (!fstab_index_build(&g_fstab_index, g_fstab)) {
+        syslog(LOG_ERR, "Out of memory while indexing %s", FSTAB_PATH);
+        fstab_index_clear(&g_fstab_index);
+        g_fstab_index = old;
+        return 0;
+    }
+
+    if (!udev) {
+        fstab_index_clear(&old);
+        return 1;
+    }
+
+    for (entry = g_fstab_index.head; entry; entry = entry->next) {
+        if (!fstab_key_same(entry, htable_find(&old.keys, entry->data)) && 
+            !fstab_collect(&devnums, &count, &size, entry->data))
+            goto out;
+    }
+    for (entry = old.head; entry; entry = entry->next) {
+        if (!htable_find(&g_fstab_index.keys, entry->data) && 
+            !fstab_collect(&devnums, &count, &size, entry->data))
+            goto out;
+    }
+
+    affected = (count) ? calloc(count, sizeof(struct props_t *)) : NULL;
+    if (count && !affected)
+        goto out;
+
+    for (j = 0; j < count; j++) {
+        device = device_search_devnum(devnums[j]);
+        if (device) {
+            props = props_ref(device->props);
+        } else {
+            dev = udev_device_new_from_devnum(udev, 'b', devnums[j]);
+            props = (dev) ? props_new(dev) : NULL;
+            udev_device_unref(dev);
+        }
+
+        if (!props)
+            continue;
+
+        if (fstab_key_same(fstab_lookup(&old, props), fstab_lookup(&g_fstab_index, props))) {
+            props_unref(props);
+            continue;
+        }
+
+        affected[naffected++] = props;
+    }
+
+    for (j = 0; j < naffected; j++) {
+        props = affected[j];
+
+        if (device_search_devnum(props->devnum))
+            device_event(EVENT_REMOVE, props);
+        device_event(EVENT_ADD, props);
+
+        props_unref(props);
+    }
+
+    free(affected);
+
+out:
+    free(devnums);
+    fstab_index_clear(&old);
+
+    return 1;
+}
+
+int 
+device_has_media (struct device_t *device) 
+{
+    if (!device)
+        return 0;
+    switch (device->type) {
+        case DEVICE_VOLUME:
+            return (device->props->fs_usage != NULL);
+        case DEVICE_CD:
+            return device->props->cdrom_media;
+	default:
+	    return 0;
+    }
+}
+
+static uint64_t
+udev_get_u64 (const char *value)
+{
+    return (value) ? strtoull(value, NULL, 10) : 0;
+}
+
+/* Copy what we care about out of a udev device so that it can be let go.
+ * The strings are staged in the draft pool first */
+static void
+props_draft_init (struct props_draft_t *draft)
+{
+    memset(&draft->props, 0, sizeof(draft->props));
+    draft->props.refs = 1;
+    draft->used = 0;
+}
+
+static const char *
+props_copy (struct props_draft_t *draft, const char *str)
+{
+    size_t len;
+    char *p;
+
+    if (!str)
+        return NULL;
+
+    len = strlen(str) + 1;
+    if (len > PROPS_DRAFT - draft->used) {
+        syslog(LOG_WARNING, "Out of room for the device properties, dropping \"%.64s\"", str);
+        return NULL;
+    }
+
+    p = memcpy(draft->pool + draft->used, str, len);
+    draft->used += len;
+
+    return p;
+}
+
+static const char *
+props_rebase (struct props_draft_t *draft, char *data, const char *str)
+{
+    uintptr_t p = (uintptr_t)str, pool = (uintptr_t)draft->pool;
+
+    /* The interned strings stay where they are */
+    if (!str || p < pool || p >= pool + draft->used)
+        return str;
+
+    return data + (p - pool);
+}
+
+/* Move the draft into a snapshot of its own, the strings right after it */
+static struct props_t *
+props_pack (struct props_draft_t *draft)
+{
+    struct props_t *props;
+    char *data;
+    int j;
+
+    props = malloc(sizeof(struct props_t) + draft->used);
+    if (!props)
+        return NULL;
+
+    *props = draft->props;
+    data = memcpy(props + 1, draft->pool, draft->used);
+
+    props->devnode = props_rebase(draft, data, props->devnode);
+    props->devtype = props_rebase(draft, data, props->devtype);
+    props->fs_type = props_rebase(draft, data, props->fs_type);
+    props->fs_uuid = props_rebase(draft, data, props->fs_uuid);
+    props->fs_label = props_rebase(draft, data, props->fs_label);
+    props->fs_usage = props_rebase(draft, data, props->fs_usage);
+    props->id_type = props_rebase(draft, data, props->id_type);
+    props->serial = props_rebase(draft, data, props->serial);
+    props->part_uuid = props_rebase(draft, data, props->part_uuid);
+    for (j = 0; j < props->ndevlinks; j++)
+        props->devlinks[j] = props_rebase(draft, data, props->devlinks[j]);
+
+    return props;
+}
+
+struct props_t *
+props_new (struct udev_device *dev)
+{
+    struct props_draft_t draft;
+    struct props_t *props = &draft.props;
+    struct udev_list_entry *entry;
+    const char *action;
+
+    props_draft_init(&draft);
+
+    props->devnum = udev_device_get_devnum(dev);
+    props->diskseq = udev_get_u64(udev_device_get_property_value(dev, "DISKSEQ"));
+    props->cdrom_media = (udev_device_get_property_value(dev, "ID_CDROM_MEDIA") != NULL);
+
+    /* There's nothing left to read once it's gone */
+    action = udev_device_get_action(dev);
+    if (!action || strcmp(action, "remove"))
+        props->size = udev_get_u64(udev_device_get_sysattr_value(dev, "size"));
+
+    props->devtype = intern(udev_device_get_devtype(dev));
+    props->fs_type = intern(udev_device_get_property_value(dev, "ID_FS_TYPE"));
+    props->fs_usage = intern(udev_device_get_property_value(dev, "ID_FS_USAGE"));
+    props->id_type = intern(udev_device_get_property_value(dev, "ID_TYPE"));
+
+    props->devnode = props_copy(&draft, udev_device_get_devnode(dev));
+    props->fs_uuid = props_copy(&draft, udev_device_get_property_value(dev, "ID_FS_UUID"));
+    props->fs_label = props_copy(&draft, udev_device_get_property_value(dev, "ID_FS_LABEL"));
+    props->serial = props_copy(&draft, udev_device_get_property_value(dev, "ID_SERIAL"));
+    props->part_uuid = props_copy(&draft, udev_device_get_property_value(dev, "ID_PART_ENTRY_UUID"));
+
+    udev_list_entry_foreach(entry, udev_device_get_devlinks_list_entry(dev)) {
+        if (props->ndevlinks == MAX_DEVLINKS)
+            break;
+        props->devlinks[props->ndevlinks] = props_copy(&draft, udev_list_entry_get_name(entry));
+        if (!props->devlinks[props->ndevlinks])
+            break;
+        props->ndevlinks++;
+    }
+
+    return props_pack(&draft);
+}
+
+struct props_t *
+props_ref (struct props_t *props)
+{
+    props->refs++;
+    return props;
+}
+
+void
+props_unref (struct props_t *props)
+{
+    if (props && !--props->refs)
+        free(props);
+}
+
+/* Tell wether the device still holds the media we mounted, the kernel bumps
+ * the diskseq every time the media changes and a new filesystem comes with a
+ * new uuid. Without either of them there's no telling, so assume it changed */
+int
+device_same_media (struct device_t *device, struct props_t *props)
+{
+    const char *uuid = props->fs_uuid;
+
+    switch (device->type) {
+        case DEVICE_VOLUME:
+            if (!props->fs_usage)
+                return 0;
+            break;
+        case DEVICE_CD:
+            if (!props->cdrom_media)
+                return 0;
+            break;
+    }
+
+    if (!device->diskseq && !device->uuid)
+        return 0;
+
+    if (props->diskseq != device->diskseq)
+        return 0;
+
+    if ((uuid || device->uuid) && (!uuid || !device->uuid || strcmp(uuid, device->uuid)))
+        return 0;
+
+    return (props->size == device->size);
+}
+
+int
+filesystem_quirks (const char *fs)
+{
+    int i;
+    static const fs_quirk_t fs_table [] = {
+        { "msdos" , QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
+        { "umsdos", QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
+        { "vfat",   QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
+        { "exfat",  QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
+        { "ntfs",   QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
+        { "iso9660",QUIRK_OWNER_FIX | QUIRK_UTF8_FLAG },
+        { "udf",    QUIRK_OWNER_FIX },
+    };
+
+    for (i = 0; i < sizeof(fs_table)/sizeof(fs_quirk_t); i++) {
+        if (!strcmp(fs_table[i].name, fs))
+            return fs_table[i].quirks;
+    }
+    return QUIRK_NONE;    
+}
+
+/* Names handed out under MOUNT_PATH. The directory is only looked at once,
+ * at startup, afterwards a name is free unless it's in the table. Each base
+ * name remembers the next numeric suffix to try so that a pile of sticks
+ * with the same label doesn't cost more and more */
+
+int
+mountpoint_scan (void)
+{
+    struct mpname_t *name;
+    struct dirent *ent;
+    DIR *dir;
+    size_t len;
+
+    dir = opendir(MOUNT_PATH);
+    if (!dir)
+        return (errno == ENOENT);
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") || 
+            htable_find(&g_mpnames, ent->d_name))
+            continue;
+
+        len = strlen(ent->d_name) + 1;
+        name = malloc(sizeof(struct mpname_t) + sizeof(MOUNT_PATH) - 1 + len);
+        if (!name) {
+            closedir(dir);
+            return 0;
+        }
+
+        /* Not ours, never released */
+        name->base = NULL;
+        memcpy(name->path, MOUNT_PATH, sizeof(MOUNT_PATH) - 1);
+        name->name = memcpy(name->path + sizeof(MOUNT_PATH) - 1, ent->d_name, len);
+        htable_insert(&g_mpnames, &name->node, name->name, 0, name);
+    }
+
+    closedir(dir);
+
+    return 1;
+}
+
+char *
+mountpoint_reserve (const char *base)
+{
+    struct mpbase_t *b;
+    struct mpname_t *name;
+    char tmp[NAME_MAX + 1];
+    size_t len;
+
+    /* Must stay a single entry right below MOUNT_PATH, no . or .. either */
+    if (!*base || base[0] == '.' || strchr(base, '/') || strlen(base) > NAME_MAX)
+        return NULL;
+
+    b = htable_find(&g_mpbases, base);
+    if (!b) {
+        len = strlen(base) + 1;
+        b = malloc(sizeof(struct mpbase_t) + len);
+        if (!b)
+            return NULL;
+        b->suffix = 1;
+        b->users = 0;
+        memcpy(b->name, base, len);
+        htable_insert(&g_mpbases, &b->node, b->name, 0, b);
+    }
+
+    strcpy(tmp, base);
+    while (htable_find(&g_mpnames, tmp)) {
+        /* We tried hard and failed */
+        if (snprintf(tmp, sizeof(tmp), "%s_%lu", base, b->suffix++) >= (int)sizeof(tmp)) {
+            tmp[0] = '\0';
+            break;
+        }
+    }
+
+    len = strlen(tmp) + 1;
+    name = (len > 1) ? malloc(sizeof(struct mpname_t) + sizeof(MOUNT_PATH) - 1 + len) : NULL;
+
+    if (!name) {
+        if (!b->users) {
+            htable_remove(&g_mpbases, &b->node);
+            free(b);
+        }
+        return NULL;
+    }
+
+    name->base = b;
+    memcpy(name->path, MOUNT_PATH, sizeof(MOUNT_PATH) - 1);
+    name->name = memcpy(name->path + sizeof(MOUNT_PATH) - 1, tmp, len);
+    htable_insert(&g_mpnames, &name->node, name->name, 0, name);
+    b->users++;
+
+    return name->path;
+}
+
+/* Give the name back, or keep it taken for good if something's left
+ * in the directory */
+void
+mountpoint_release (const char *path, int keep)
+{
+    struct mpname_t *name;
+    struct mpbase_t *b;
+
+    if (strncmp(path, MOUNT_PATH, sizeof(MOUNT_PATH) - 1))
+        return;
+
+    name = htable_find(&g_mpnames, path + sizeof(MOUNT_PATH) - 1);
+    if (!name || !name->base)
+        return;
+
+    b = name->base;
+    if (keep) {
+        name->base = NULL;
+    } else {
+        htable_remove(&g_mpnames, &name->node);
+        free(name);
+    }
+
+    /* Start counting from scratch once the last one is gone */
+    if (!--b->users) {
+        htable_remove(&g_mpbases, &b->node);
+        free(b);
+    }
+}
+
+void
+mountpoint_clear (void)
+{
+    htable_free_all(&g_mpnames);
+    htable_free_all(&g_mpbases);
+}
+
+char *
+device_create_mountpoint (struct device_t *device)
+{
+    char tmp[PATH_MAX];
+    char *c, *path;
+    const char *label, *uuid, *serial;
+
+    label = device->props->fs_label;
+    uuid = device->props->fs_uuid;
+    serial = device->props->serial;
+
+    if (label && *label)
+        snprintf(tmp, sizeof(tmp), "%s", label);
+    else if (uuid && *uuid)
+        snprintf(tmp, sizeof(tmp), "%s", uuid);
+    else if (serial && *serial)
+        snprintf(tmp, sizeof(tmp), "%s", serial);
+    else
+        return NULL;
+
+    /* Replace the whitespaces and the slashes */
+    for (c = tmp; *c; c++) {
+       if (*c == ' ' || *c == '/')
+           *c = '_';
+    }
+
+    /* The label is up to whoever made the stick, don't let it name . or .. */
+    if (tmp[0] == '.')
+        tmp[0] = '_';
+
+    path = mountpoint_reserve(tmp);
+    if (path)
+        device->mountpoint_reserved = 1;
+
+    return path;
+}
+
+/* The name was taken by a directory made after we looked, leave it alone
+ * and queue the mount again with the next free one */
+int
+device_rename_mountpoint (struct device_t *device)
+{
+    char *path;
+
+    path = device_create_mountpoint(device);
+    if (!path)
+        return 0;
+
+    htable_remove(&g_devices.mountpoints, &device->by_mountpoint);
+    mountpoint_release(device->mountpoint, 1);
+    device->mountpoint = path;
+    htable_insert(&g_devices.mountpoints, &device->by_mountpoint, path, 0, device);
+    g_devices.dirty = 1;
+
+    return workers_submit(device, JOB_MOUNT);
+}
+
+void 
+device_list_clear (void)
+{
+    struct device_t *dev, *next;
+
+    /* Let the workers settle first */
+    workers_drain();
+
+    for (dev = g_devices.head; dev; dev = next) {
+        next = dev->next;
+        device_unmount(dev->props);
+    }
+
+    workers_drain();
+}
+
+int
+device_register (struct device_t *dev)
+{
+    if (!htable_insert(&g_devices.devnodes, &dev->by_devnode, dev->devnode, 0, dev))
+        return 0;
+
+    if (!htable_insert(&g_devices.mountpoints, &dev->by_mountpoint, dev->mountpoint, 0, dev)) {
+        htable_remove(&g_devices.devnodes, &dev->by_devnode);
+        return 0;
+    }
+
+    if (!htable_insert(&g_devices.devnums, &dev->by_devnum, NULL, (uint64_t)dev->devnum, dev)) {
+        htable_remove(&g_devices.devnodes, &dev->by_devnode);
+        htable_remove(&g_devices.mountpoints, &dev->by_mountpoint);
+        return 0;
+    }
+
+    dev->prev = NULL;
+    dev->next = g_devices.head;
+    if (g_devices.head)
+        g_devices.head->prev = dev;
+    g_devices.head = dev;
+    g_devices.count++;
+    g_devices.dirty = 1;
+
+    dev->registered = 1;
+
+    return 1;
+}
+
+static void
+device_unregister (struct device_t *dev)
+{
+    htable_remove(&g_devices.devnodes, &dev->by_devnode);
+    htable_remove(&g_devices.mountpoints, &dev->by_mountpoint);
+    htable_remove(&g_devices.devnums, &dev->by_devnum);
+
+    if (dev->prev)
+        dev->prev->next = dev->next;
+    else
+        g_devices.head = dev->next;
+    if (dev->next)
+        dev->next->prev = dev->prev;
+    g_devices.count--;
+    g_devices.dirty = 1;
+
+    dev->registered = 0;
+}
+
+void
+device_destroy (struct device_t *dev)
+{
+    struct pending_t *pending, *next;
+
+    /* Might happen that we have to destroy a device not yet
+     * registered. Just free it */
+    if (dev->registered)
+        device_unregister(dev);
+
+    if (dev->mountpoint_reserved)
+        mountpoint_release(dev->mountpoint, 0);
+    else
+        free(dev->mountpoint);
+    props_unref(dev->props);
+
+    for (pending = dev->pending; pending; pending = next) {
+        next = pending->next;
+        props_unref(pending->props);
+        slab_free(&g_pending_slab, pending);
+    }
+
+    slab_free(&g_device_slab, dev);
+}
+
+/* Path is either the /dev/ node or the mountpoint */
+struct device_t *
+device_search (const char *path)
+{
+    struct device_t *dev;
+
+    if (!path)
+        return NULL;
+
+    dev = htable_find(&g_devices.devnodes, path);
+    if (!dev)
+        dev = htable_find(&g_devices.mountpoints, path);
+
+    return dev;
+}
+
+struct device_t *
+device_search_devnum (dev_t devnum)
+{
+    return htable_find_num(&g_devices.devnums, (uint64_t)devnum);
+}
+
+/* Mount table. It's rebuilt from mountinfo by diffing against the previous
+ * snapshot, the mounts still there are just marked with the new generation
+ * and the ones left behind are the ones that went away */
+
+static void
+mtab_unescape (char *str)
+{
+    char *p = str;
+
+    /* Spaces and friends are escaped as \ooo */
+    while (*str) {
+        if (str[0] == '\\' && 
+            str[1] >= '0' && str[1] <= '3' && 
+            str[2] >= '0' && str[2] <= '7' && 
+            str[3] >= '0' && str[3] <= '7') {
+            *p++ = (char)(((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0'));
+            str += 4;
+        } else {
+            *p++ = *str++;
+        }
+    }
+    *p = '\0';
+}
+
+static void
+mtab_remove (struct mount_t *mnt)
+{
+    htable_remove(&g_mtab.ids, &mnt->by_id);
+    htable_remove(&g_mtab.devnums, &mnt->by_devnum);
+    if (mnt->source)
+        htable_remove(&g_mtab.sources, &mnt->by_source);
+
+    if (mnt->prev)
+        mnt->prev->next = mnt->next;
+    else
+        g_mtab.head = mnt->next;
+    if (mnt->next)
+        mnt->next->prev = mnt->prev;
+}
+
+static struct mount_t *
+mtab_add (uint64_t id, dev_t devnum, const char *source, const char *target)
+{
+    struct mount_t *mnt;
+    size_t source_len, target_len;
+
+    source_len = (source) ? strlen(source) + 1 : 0;
+    target_len = strlen(target) + 1;
+
+    mnt = malloc(sizeof(struct mount_t) + source_len + target_len);
+
+    if (!mnt)
+        return NULL;
+
+    mnt->id = id;
+    mnt->devnum = devnum;
+    mnt->seen = g_mtab.generation;
+    mnt->target = memcpy(mnt->data, target, target_len);
+    mnt->source = (source) ? memcpy(mnt->data + target_len, source, source_len) : NULL;
+
+    htable_insert(&g_mtab.ids, &mnt->by_id, NULL, id, mnt);
+    htable_insert(&g_mtab.devnums, &mnt->by_devnum, NULL, (uint64_t)devnum, mnt);
+    if (mnt->source)
+        htable_insert(&g_mtab.sources, &mnt->by_source, mnt->source, 0, mnt);
+
+    mnt->prev = NULL;
+    mnt->next = g_mtab.head;
+    if (g_mtab.head)
+        g_mtab.head->prev = mnt;
+    g_mtab.head = mnt;
+
+    return mnt;
+}
+
+/* Slurp the whole file in one go, the buffer is kept around for the next time */
+static ssize_t
+mtab_read (void)
+{
+    size_t len;
+    ssize_t n;
+    char *buf;
+    int fd;
+
+    fd = open(MTAB_PATH, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    len = 0;
+
+    for (;;) {
+        if (len + 1 >= g_mtab.bufsize) {
+            buf = realloc(g_mtab.buf, g_mtab.bufsize ? g_mtab.bufsize * 2 : 65536);
+            if (!buf) {
+                close(fd);
+                return -1;
+            }
+            g_mtab.buf = buf;
+            g_mtab.bufsize = g_mtab.bufsize ? g_mtab.bufsize * 2 : 65536;
+        }
+
+        n = read(fd, g_mtab.buf + len, g_mtab.bufsize - len - 1);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        if (n == 0)
+            break;
+
+        len += (size_t)n;
+    }
+
+    close(fd);
+
+    g_mtab.buf[len] = '\0';
+
+    return (ssize_t)len;
+}
+
+/* Move the mounts not seen in this generation on the gone list */
+static void
+mtab_sweep (struct mount_t **gone)
+{
+    struct mount_t *mnt, *next;
+
+    for (mnt = g_mtab.head; mnt; mnt = next) {
+        next = mnt->next;
+        if (mnt->seen != g_mtab.generation) {
+            mtab_remove(mnt);
+            mnt->next = *gone;
+            *gone = mnt;
+        }
+    }
+}
+
+/* Look up a single mount and add it to the table */
+static int
+mtab_statmount (uint64_t id)
+{
+    struct ldm_mnt_id_req req;
+    struct ldm_statmount *sm;
+    const char *source;
+    char *buf;
+
+    for (;;) {
+        if (g_mtab.bufsize < 4096) {
+            buf = realloc(g_mtab.buf, 4096);
+            if (!buf)
+                return 0;
+            g_mtab.buf = buf;
+            g_mtab.bufsize = 4096;
+        }
+
+        req.size = sizeof(req);
+        req.spare = 0;
+        req.mnt_id = id;
+        req.param = STATMOUNT_SB_BASIC | STATMOUNT_MNT_POINT;
+        if (!g_mtab.no_source)
+            req.param |= STATMOUNT_SB_SOURCE;
+
+        if (syscall(SYS_statmount, &req, g_mtab.buf, g_mtab.bufsize, 0) == 0)
+            break;
+
+        /* Unmounted in the meanwhile */
+        if (errno == ENOENT)
+            return 1;
+        /* The source is a 6.11 addition */
+        if (errno == EINVAL && !g_mtab.no_source) {
+            g_mtab.no_source = 1;
+            continue;
+        }
+        if (errno != EOVERFLOW)
+            return 0;
+
+        buf = realloc(g_mtab.buf, g_mtab.bufsize * 2);
+        if (!buf)
+            return 0;
+        g_mtab.buf = buf;
+        g_mtab.bufsize *= 2;
+    }
+
+    sm = (struct ldm_statmount *)g_mtab.buf;
+
+    if (!(sm->mask & STATMOUNT_SB_BASIC) || !(sm->mask & STATMOUNT_MNT_POINT))
+        return 1;
+
+    source = (sm->mask & STATMOUNT_SB_SOURCE) ? sm->str + sm->sb_source : NULL;
+
+    mtab_add(id, makedev(sm->sb_dev_major, sm->sb_dev_minor), 
+             (source && source[0] == '/') ? source : NULL, sm->str + sm->mnt_point);
+
+    return 1;
+}
+
+/* Walk the namespace with listmount. The unique ids are never recycled so 
+ * only the mounts we haven't seen yet need a statmount */
+static int
+mtab_listmount (struct mount_t **gone)
+{
+    struct ldm_mnt_id_req req;
+    struct mount_t *mnt;
+    uint64_t ids[LISTMOUNT_BATCH];
+    uint64_t last;
+    long n, j;
+
+    g_mtab.generation++;
+
+    last = 0;
+
+    for (;;) {
+        req.size = sizeof(req);
+        req.spare = 0;
+        req.mnt_id = LSMT_ROOT;
+        req.param = last;
+
+        n = syscall(SYS_listmount, &req, ids, (size_t)LISTMOUNT_BATCH, 0);
+
+        if (n < 0)
+            return 0;
+
+        for (j = 0; j < n; j++) {
+            mnt = htable_find_num(&g_mtab.ids, ids[j]);
+            if (mnt)
+                mnt->seen = g_mtab.generation;
+            else if (!mtab_statmount(ids[j]))
+                return 0;
+        }
+
+        if (n < LISTMOUNT_BATCH)
+            break;
+
+        last = ids[n - 1];
+    }
+
+    mtab_sweep(gone);
+
+    return 1;
+}
+
+/* Parse mountinfo and move the mounts that went away on the gone list */
+static int
+mtab_parse (struct mount_t **gone)
+{
+    struct mount_t *mnt;
+    char *line, *eol, *fields[10], *p;
+    uint64_t id;
+    unsigned int major, minor;
+    dev_t devnum;
+    int j;
+
+    if (g_mtab.backend != MTAB_PROCFS) {
+        if (mtab_listmount(gone)) {
+            g_mtab.backend = MTAB_LISTMOUNT;
+            return 1;
+        }
+        /* Pre 6.8 kernel or a seccomp filter in the way */
+        if (g_mtab.backend == MTAB_LISTMOUNT)
+            return 0;
+        syslog(LOG_INFO, "listmount isn't available, falling back to %s", MTAB_PATH);
+        g_mtab.backend = MTAB_PROCFS;
+    }
+
+    if (mtab_read() < 0)
+        return 0;
+
+    g_mtab.generation++;
+
+    for (line = g_mtab.buf; *line; line = eol) {
+        eol = strchr(line, '\n');
+        if (eol)
+            *eol++ = '\0';
+        else
+            eol = line + strlen(line);
+
+        /* id parent major:minor root target options [optional...] - fstype source superoptions */
+        for (j = 0, p = line; j < 10 && p; j++) {
+            fields[j] = strsep(&p, " ");
+            /* Skip the optional fields */
+            if (j == 6) {
+                while (fields[j] && strcmp(fields[j], "-"))
+                    fields[j] = strsep(&p, " ");
+            }
+        }
+
+        if (j < 9 || !fields[6])
+            continue;
+
+        id = strtoull(fields[0], NULL, 10);
+        if (sscanf(fields[2], "%u:%u", &major, &minor) != 2)
+            continue;
+        devnum = makedev(major, minor);
+
+        mtab_unescape(fields[4]);
+        mtab_unescape(fields[8]);
+
+        mnt = htable_find_num(&g_mtab.ids, id);
+
+        /* Same old mount, unless the id has been recycled */
+        if (mnt && mnt->devnum == devnum && !strcmp(mnt->target, fields[4])) {
+            mnt->seen = g_mtab.generation;
+            continue;
+        }
+
+        if (mnt) {
+            mtab_remove(mnt);
+            mnt->next = *gone;
+            *gone = mnt;
+        }
+
+        /* Pseudo filesystems have "none" or the fs name as source */
+        mtab_add(id, devnum, (fields[8][0] == '/') ? fields[8] : NULL, fields[4]);
+    }
+
+    mtab_sweep(gone);
+
+    return 1;
+}
+
+/* Btrfs and friends have an anonymous major:minor, hence the source */
+struct mount_t *
+mtab_find (dev_t devnum, const char *source)
+{
+    struct mount_t *mnt;
+
+    mnt = htable_find_num(&g_mtab.devnums, (uint64_t)devnum);
+
+    if (!mnt && source)
+        mnt = htable_find(&g_mtab.sources, source);
+
+    return mnt;
+}
+
+void
+mtab_clear (void)
+{
+    struct mount_t *mnt;
+
+    while ((mnt = g_mtab.head)) {
+        mtab_remove(mnt);
+        free(mnt);
+    }
+
+    htable_free(&g_mtab.ids);
+    htable_free(&g_mtab.devnums);
+    htable_free(&g_mtab.sources);
+
+    free(g_mtab.buf);
+    g_mtab.buf = NULL;
+    g_mtab.bufsize = 0;
+}
+
+int
+device_is_mounted (struct props_t *props)
+{
+    return (mtab_find(props->devnum, props->devnode) != NULL);
+}
+
+struct device_t *
+device_new (struct props_t *props)
+{
+    struct device_t *device;
+    struct fstab_key_t *fstab_entry;
+
+    const char *dev_type;
+    const char *dev_idtype;
+   
+    /* First of all check wether we're dealing with a noauto device */
+    fstab_entry = fstab_lookup(&g_fstab_index, props);
+    if (fstab_entry && fstab_entry->noauto) 
+        return NULL;
+
+    device = slab_alloc(&g_device_slab);
+
+    if (!device)
+        return NULL;
+
+    device->props = props_ref(props);
+
+    device->devnum = props->devnum;
+    device->devnode = props->devnode;
+    device->filesystem = props->fs_type;
+    device->uuid = props->fs_uuid;
+    device->diskseq = props->diskseq;
+    device->size = props->size;
+
+    dev_type    = props->devtype;
+    dev_idtype  = props->id_type;
+
+    device->type = DEVICE_UNK;
+
+    /* Avoid mounting swap partitions because we're not intrested in those and LVM/LUKS 
+     * containers as udev issues another event for each single partition contained in them */
+    if (!device->filesystem || 
+        !strcmp(device->filesystem, "swap") || 
+        !strcmp(device->filesystem, "LVM2_member") || 
+        !strcmp(device->filesystem, "crypto_LUKS")) { 
+        device_destroy(device);
+        return NULL;
+    }
+
+    if (!strcmp(dev_type,   "partition")|| 
         !strcmp(dev_type,   "disk")     || 
         !strcmp(dev_idtype, "floppy"))  {
         device->type = DEVICE_VOLUME;
@@ -406,281 +2938,2417 @@ device_new (struct udev_device *dev)
     if (dev_idtype && !strcmp(dev_idtype, "cd")) 
         device->type = DEVICE_CD;
 
-    if (device->type == DEVICE_UNK) {
-        device_destroy(device);
-        return NULL;
+    if (device->type == DEVICE_UNK) {
+        device_destroy(device);
+        return NULL;
+    }
+
+    if (!device_has_media(device)) {
+        device_destroy(device);
+        return NULL;
+    }
+
+    device->mountpoint = (fstab_entry) ? 
+        s_strdup(fstab_entry->target) : 
+        device_create_mountpoint(device);
+
+    if (!device->mountpoint) {
+        syslog(LOG_ERR, "Couldn't make up a mountpoint name. Please report this bug.");
+        device_destroy(device);
+        return NULL;
+    }
+
+    if (!device_register(device)) {
+        device_destroy(device);
+        return NULL;
+    }
+
+    return device;
+}
+
+/* Mount workers. The main loop only ever dispatches one job per device at a
+ * time, the events arriving in the meanwhile are queued on the device and
+ * replayed once the job completes, so the per-devnode ordering is kept */
+
+/* Filesystems with a mount.<type> helper (fuse ones, mostly) are left to
+ * libmount, which knows how to run it */
+static int
+filesystem_has_helper (const char *fs)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "/sbin/mount.%s", fs);
+    if (!access(path, X_OK))
+        return 1;
+
+    snprintf(path, sizeof(path), "/usr/sbin/mount.%s", fs);
+    return !access(path, X_OK);
+}
+
+static void
+fsapi_log (int fsfd, const char *devnode)
+{
+    char buf[256];
+    ssize_t len;
+
+    while ((len = read(fsfd, buf, sizeof(buf) - 1)) > 0) {
+        buf[len] = '\0';
+        syslog(LOG_ERR, "%s: %s", devnode, buf);
+    }
+}
+
+/* Mount through the new mount API: the superblock is set up on a detached
+ * mount that gets attached to the mountpoint only once it's ready, so a
+ * failure never leaves anything half mounted behind. Returns 1 if mounted,
+ * -1 on error and 0 if libmount should handle this one instead */
+static int
+job_mount_fsapi (struct job_t *job)
+{
+    struct device_t *device = job->device;
+    char opts[sizeof(job->options)];
+    char *opt, *val, *save;
+    unsigned int attrs = 0;
+    int fsfd, mntfd, err;
+
+    if (__atomic_load_n(&g_no_fsapi, __ATOMIC_RELAXED) || 
+        !device->filesystem || filesystem_has_helper(device->filesystem))
+        return 0;
+
+    fsfd = (int)syscall(SYS_fsopen, device->filesystem, FSOPEN_CLOEXEC);
+    if (fsfd < 0) {
+        if (errno == ENOSYS)
+            __atomic_store_n(&g_no_fsapi, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* Whatever the new API doesn't take is left to libmount, which knows
+     * how to hand the options to each filesystem */
+    if (syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "source", device->devnode, 0) < 0)
+        goto fallback;
+
+    strcpy(opts, job->options);
+    for (opt = strtok_r(opts, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        val = strchr(opt, '=');
+        if (val)
+            *val++ = '\0';
+        if (syscall(SYS_fsconfig, fsfd, val ? FSCONFIG_SET_STRING : FSCONFIG_SET_FLAG, opt, val, 0) < 0)
+            goto fallback;
+    }
+
+    if (job->mflags & MS_RDONLY) {
+        if (syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_FLAG, "ro", NULL, 0) < 0)
+            goto fallback;
+        attrs |= MOUNT_ATTR_RDONLY;
+    }
+    if (job->mflags & MS_NOSUID)
+        attrs |= MOUNT_ATTR_NOSUID;
+    if (job->mflags & MS_NODEV)
+        attrs |= MOUNT_ATTR_NODEV;
+    if (job->mflags & MS_NOEXEC)
+        attrs |= MOUNT_ATTR_NOEXEC;
+
+    if (syscall(SYS_fsconfig, fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0) {
+        /* Write protected media, libmount retries read-only */
+        if (!(job->mflags & MS_RDONLY) && (errno == EROFS || errno == EACCES)) {
+            close(fsfd);
+            return 0;
+        }
+        goto fail;
+    }
+
+    mntfd = (int)syscall(SYS_fsmount, fsfd, FSMOUNT_CLOEXEC, attrs);
+    if (mntfd < 0)
+        goto fail;
+    close(fsfd);
+
+    /* Hand it over to the user before anybody can see it */
+    if ((!job->owner_fix && fchownat(mntfd, "", (uid_t)g_uid, (gid_t)g_gid, AT_EMPTY_PATH) < 0) || 
+        syscall(SYS_move_mount, mntfd, "", AT_FDCWD, device->mountpoint, MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+        err = errno;
+        close(mntfd);
+        errno = err;
+        return -1;
+    }
+
+    close(mntfd);
+
+    return 1;
+
+fallback:
+    fsapi_log(fsfd, device->devnode);
+    close(fsfd);
+
+    return 0;
+
+fail:
+    err = errno;
+    fsapi_log(fsfd, device->devnode);
+    close(fsfd);
+    errno = err;
+
+    return -1;
+}
+
+/* The classic way, through libmount. Returns 1 if mounted */
+static int
+job_mount_libmount (struct job_t *job, struct libmnt_context *ctx)
+{
+    struct device_t *device = job->device;
+
+    if (!ctx) {
+        job->ret = -1;
+        job->err = ENOMEM;
+        rmdir(device->mountpoint);
+        return 0;
+    }
+
+    mnt_context_set_fstype(ctx, device->filesystem);
+    mnt_context_set_source(ctx, device->devnode);
+    mnt_context_set_target(ctx, device->mountpoint);
+    mnt_context_set_options(ctx, job->options);
+
+    if (job->mflags) 
+        mnt_context_set_mflags(ctx, job->mflags);
+
+    if (mnt_context_mount(ctx)) {
+        job->ret = -1;
+        job->err = errno;
+        rmdir(device->mountpoint);
+        return 0;
+    }
+
+    if (!job->owner_fix) {
+        if (chown(device->mountpoint, (__uid_t)g_uid, (__gid_t)g_gid)) {
+            job->ret = -1;
+            job->err = errno;
+            umount(device->mountpoint);
+            rmdir(device->mountpoint);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+job_mount (struct job_t *job, struct libmnt_context *ctx)
+{
+    struct device_t *device = job->device;
+    struct statx stx;
+    int ret;
+
+    /* Someone else's directory, only fstab targets are expected to exist */
+    if (mkdir(device->mountpoint, 755) < 0 && errno == EEXIST && device->mountpoint_reserved) {
+        job->ret = -1;
+        job->err = EEXIST;
+        return;
+    }
+
+    ret = job_mount_fsapi(job);
+
+    if (ret < 0) {
+        job->ret = -1;
+        job->err = errno;
+        rmdir(device->mountpoint);
+        return;
+    }
+
+    if (ret == 0 && !job_mount_libmount(job, ctx))
+        return;
+
+    /* So that the main loop can account for the mount without a rescan */
+    if (!statx(AT_FDCWD, device->mountpoint, AT_NO_AUTOMOUNT, job->mnt_id_mask, &stx) && 
+        (stx.stx_mask & job->mnt_id_mask))
+        job->mnt_id = stx.stx_mnt_id;
+
+    job->ret = 0;
+}
+
+static void
+job_unmount (struct job_t *job, struct libmnt_context *ctx)
+{
+    if (!ctx) {
+        job->ret = -1;
+        job->err = ENOMEM;
+        return;
+    }
+
+    mnt_context_set_target(ctx, job->device->devnode);
+
+    job->ret = mnt_context_umount(ctx) ? -1 : 0;
+    job->err = errno;
+}
+
+static void *
+worker_main (void *arg)
+{
+    struct libmnt_context *ctx;
+    struct job_t *job;
+    const uint64_t one = 1;
+
+    (void)arg;
+
+    /* Every worker keeps its own context around and resets it between jobs.
+     * The devnode and the mountpoint are canonical already, don't make
+     * libmount resolve them again */
+    ctx = mnt_new_context();
+    if (ctx)
+        mnt_context_disable_canonicalize(ctx, 1);
+
+    for (;;) {
+        pthread_mutex_lock(&g_jobs_lock);
+        while (!g_jobs_head && !g_jobs_quit)
+            pthread_cond_wait(&g_jobs_cond, &g_jobs_lock);
+        if (!g_jobs_head) {
+            pthread_mutex_unlock(&g_jobs_lock);
+            break;
+        }
+        job = g_jobs_head;
+        g_jobs_head = job->next;
+        if (!g_jobs_head)
+            g_jobs_tail = NULL;
+        pthread_mutex_unlock(&g_jobs_lock);
+
+        if (job->type == JOB_MOUNT)
+            job_mount(job, ctx);
+        else
+            job_unmount(job, ctx);
+
+        if (ctx)
+            mnt_reset_context(ctx);
+
+        job->next = NULL;
+
+        pthread_mutex_lock(&g_jobs_lock);
+        if (g_done_tail)
+            g_done_tail->next = job;
+        else
+            g_done_head = job;
+        g_done_tail = job;
+        pthread_mutex_unlock(&g_jobs_lock);
+
+        /* Wake up the main loop */
+        write(g_donefd, &one, sizeof(one));
+    }
+
+    mnt_free_context(ctx);
+
+    return NULL;
+}
+
+int
+workers_init (void)
+{
+    g_donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (g_donefd < 0) {
+        syslog(LOG_ERR, "Cannot create the completion eventfd");
+        return 0;
+    }
+
+    for (g_nworkers = 0; g_nworkers < g_parallel; g_nworkers++) {
+        if (pthread_create(&g_workers[g_nworkers], NULL, worker_main, NULL))
+            break;
+    }
+
+    if (!g_nworkers) {
+        syslog(LOG_ERR, "Cannot spawn the mount workers");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+workers_submit (struct device_t *device, int type)
+{
+    struct job_t *job;
+    char *p;
+    int quirks;
+
+    job = slab_alloc(&g_job_slab);
+
+    if (!job)
+        return 0;
+
+    job->type = type;
+    job->device = device;
+
+    if (type == JOB_MOUNT) {
+        p = job->options;
+
+        /* Some filesystems just want to watch the world burn */
+        quirks = filesystem_quirks(device->filesystem);
+
+        if (quirks != QUIRK_NONE) {
+            /* Microsoft filesystems and filesystems used on optical 
+             * discs require the gid and uid to be passed as mount 
+             * arguments to allow the user to read and write, while 
+             * posix filesystems just need a chown after being mounted */
+            if (quirks & QUIRK_OWNER_FIX)
+                p += sprintf(p, OPT_FMT",", g_uid, g_gid);
+            if (quirks & QUIRK_UTF8_FLAG)
+                p += sprintf(p, "utf8,");
+        }
+        *p = 0;
+
+        job->owner_fix = (quirks & QUIRK_OWNER_FIX);
+        job->mnt_id_mask = (g_mtab.backend == MTAB_LISTMOUNT) ? STATX_MNT_ID_UNIQUE : STATX_MNT_ID;
+
+        if (device->type == DEVICE_CD) 
+            job->mflags = MS_RDONLY;
+
+        device->state = DEVICE_STATE_MOUNTING;
+    } else {
+        device->state = DEVICE_STATE_UNMOUNTING;
+    }
+
+    g_devices.dirty = 1;
+
+    pthread_mutex_lock(&g_jobs_lock);
+    if (g_jobs_tail)
+        g_jobs_tail->next = job;
+    else
+        g_jobs_head = job;
+    g_jobs_tail = job;
+    pthread_cond_signal(&g_jobs_cond);
+    pthread_mutex_unlock(&g_jobs_lock);
+
+    g_jobs_inflight++;
+
+    return 1;
+}
+
+/* Replay the events queued while the device was busy */
+static void
+device_replay (struct pending_t *pending)
+{
+    struct pending_t *next;
+
+    for (; pending; pending = next) {
+        next = pending->next;
+        /* Don't start anything new while shutting down */
+        if (g_running)
+            device_event(pending->action, pending->props);
+        props_unref(pending->props);
+        slab_free(&g_pending_slab, pending);
+    }
+}
+
+static struct pending_t *
+device_take_pending (struct device_t *device)
+{
+    struct pending_t *pending;
+
+    pending = device->pending;
+    device->pending = device->pending_tail = NULL;
+
+    return pending;
+}
+
+/* The media is gone, tear down what's left of the device */
+static void
+device_release (struct device_t *device)
+{
+    struct pending_t *pending;
+
+    if (rmdir(device->mountpoint) && errno != ENOENT && device->mountpoint_reserved)
+        mountpoint_release(device->mountpoint, 1);
+
+    notify_callbacks("unmount", device);
+
+    pending = device_take_pending(device);
+    device_destroy(device);
+    device_replay(pending);
+}
+
+static void
+job_complete (struct job_t *job)
+{
+    struct device_t *device = job->device;
+    struct pending_t *pending;
+
+    g_jobs_inflight--;
+
+    if (job->type == JOB_MOUNT) {
+        if (job->ret && job->err == EEXIST && device->mountpoint_reserved) {
+            syslog(LOG_WARNING, "%s already exists, not mounting %s over it", device->mountpoint, device->devnode);
+            if (device_rename_mountpoint(device))
+                return;
+        }
+        if (job->ret) {
+            syslog(LOG_ERR, "Error while mounting %s (%s)", device->devnode, strerror(job->err));
+            pending = device_take_pending(device);
+            device_destroy(device);
+            device_replay(pending);
+            return;
+        }
+
+        device->state = DEVICE_STATE_MOUNTED;
+        g_devices.dirty = 1;
+
+        mtab_self_mount(device, job->mnt_id);
+
+        notify_callbacks("mount", device);
+
+        device_replay(device_take_pending(device));
+    } else {
+        /* Unmounting something that's already gone is fine */
+        if (job->ret && device_is_mounted(device->props)) {
+            syslog(LOG_ERR, "Error while unmounting %s (%s)", device->devnode, strerror(job->err));
+            device->state = DEVICE_STATE_MOUNTED;
+            g_devices.dirty = 1;
+            device_replay(device_take_pending(device));
+            return;
+        }
+
+        mtab_self_unmount(device);
+
+        device_release(device);
+    }
+}
+
+void
+workers_complete (void)
+{
+    struct job_t *job, *next;
+    uint64_t count;
+
+    read(g_donefd, &count, sizeof(count));
+
+    pthread_mutex_lock(&g_jobs_lock);
+    job = g_done_head;
+    g_done_head = g_done_tail = NULL;
+    pthread_mutex_unlock(&g_jobs_lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        job_complete(job);
+        slab_free(&g_job_slab, job);
+    }
+}
+
+/* Block until every submitted job has been completed */
+void
+workers_drain (void)
+{
+    struct pollfd pfd;
+
+    pfd.fd = g_donefd;
+    pfd.events = POLLIN;
+
+    while (g_jobs_inflight > 0) {
+        if (poll(&pfd, 1, -1) > 0)
+            workers_complete();
+    }
+}
+
+void
+workers_stop (void)
+{
+    int j;
+
+    pthread_mutex_lock(&g_jobs_lock);
+    g_jobs_quit = 1;
+    pthread_cond_broadcast(&g_jobs_cond);
+    pthread_mutex_unlock(&g_jobs_lock);
+
+    for (j = 0; j < g_nworkers; j++)
+        pthread_join(g_workers[j], NULL);
+    g_nworkers = 0;
+
+    if (g_donefd >= 0)
+        close(g_donefd);
+    g_donefd = -1;
+}
+
+int
+device_mount (struct props_t *props)
+{
+    struct device_t *device;
+ 
+    /* Already taken care of */
+    if (device_search(props->devnode))
+        return 0;
+
+    device = device_new(props);
+
+    if (!device)
+        return 0;
+
+    if (!workers_submit(device, JOB_MOUNT)) {
+        device_destroy(device);
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+device_unmount (struct props_t *props)
+{
+    struct device_t *device;
+
+    device = device_search(props->devnode);
+
+    if (!device) 
+        return 0;
+
+    if (device->state == DEVICE_STATE_MOUNTED)
+        return workers_submit(device, JOB_UNMOUNT);
+
+    device_release(device);
+    
+    return 1;
+}
+
+int 
+device_change (struct props_t *props)
+{
+    struct device_t *device;
+
+    device = device_search(props->devnode);
+
+    /* A partition table reread or whatever, spare the remount */
+    if (device && device->state == DEVICE_STATE_MOUNTED && device_same_media(device, props))
+        return 1;
+
+    /* Unmount the old media... */
+    if (device) {
+        if (!device_unmount(props)) 
+            return 0;
+        /* ...and mount the new one once the old one is gone */
+        device = device_search(props->devnode);
+        if (device)
+            return device_event(EVENT_CHANGE, props);
+    }
+
+    if (!device_mount(props))
+        return 0;
+
+    return 1;
+}
+
+int
+event_action (const char *action)
+{
+    if (!action)
+        return EVENT_UNK;
+    if (!strcmp(action, "add"))
+        return EVENT_ADD;
+    if (!strcmp(action, "remove"))
+        return EVENT_REMOVE;
+    if (!strcmp(action, "change"))
+        return EVENT_CHANGE;
+    return EVENT_UNK;
+}
+
+int
+device_event (int action, struct props_t *props)
+{
+    struct device_t *device;
+    struct pending_t *pending;
+
+    device = device_search(props->devnode);
+
+    /* Wait for the worker to be done with it */
+    if (device && (device->state == DEVICE_STATE_MOUNTING || device->state == DEVICE_STATE_UNMOUNTING)) {
+        pending = slab_alloc(&g_pending_slab);
+        if (!pending)
+            return 0;
+
+        pending->action = action;
+        pending->props = props_ref(props);
+        pending->next = NULL;
+
+        if (device->pending_tail)
+            device->pending_tail->next = pending;
+        else
+            device->pending = pending;
+        device->pending_tail = pending;
+
+        return 1;
+    }
+
+    switch (action) {
+        case EVENT_ADD:
+            return device_mount(props);
+        case EVENT_REMOVE:
+            return device_unmount(props);
+        case EVENT_CHANGE:
+            return device_change(props);
+    }
+
+    return 0;
+}
+
+/* Status readers. The registry is published as an immutable snapshot once
+ * per loop iteration if anything changed, the readers grab the current one
+ * without any lock. A replaced snapshot is freed once no reader that could
+ * have seen it is still around: readers announce the epoch they entered at,
+ * every replacement bumps the epoch */
+
+static const char *
+state_name (int state)
+{
+    switch (state) {
+        case DEVICE_STATE_PROBING:
+            return "probing";
+        case DEVICE_STATE_MOUNTING:
+            return "mounting";
+        case DEVICE_STATE_MOUNTED:
+            return "mounted";
+        case DEVICE_STATE_UNMOUNTING:
+            return "unmounting";
+    }
+
+    return "unknown";
+}
+
+static void
+snapshot_reclaim (void)
+{
+    struct snapshot_t **p, *snap;
+    unsigned long epoch;
+    int j, busy;
+
+    for (p = &g_retired; (snap = *p); ) {
+        busy = 0;
+        for (j = 0; j < STATUS_THREADS; j++) {
+            epoch = __atomic_load_n(&g_reader_epoch[j], __ATOMIC_SEQ_CST);
+            if (epoch && epoch <= snap->retired)
+                busy = 1;
+        }
+
+        if (busy) {
+            p = &snap->next;
+            continue;
+        }
+
+        *p = snap->next;
+        free(snap);
+    }
+}
+
+/* Copy the registry out, the strings follow the entries */
+void
+registry_publish (void)
+{
+    struct snapshot_t *snap, *old;
+    struct device_t *dev;
+    const char *fs;
+    size_t len, n;
+    char *p;
+    int j;
+
+    if (!g_devices.dirty && g_snapshot)
+        return;
+
+    len = 0;
+    for (dev = g_devices.head; dev; dev = dev->next) {
+        fs = (dev->filesystem) ? dev->filesystem : "";
+        len += strlen(dev->devnode) + strlen(dev->mountpoint) + strlen(fs) + 3;
+    }
+
+    snap = malloc(sizeof(struct snapshot_t) + g_devices.count * sizeof(struct snap_entry_t) + len);
+    if (!snap)
+        return;
+
+    snap->version = (g_snapshot) ? g_snapshot->version + 1 : 1;
+    snap->next = NULL;
+    snap->count = (int)g_devices.count;
+
+    p = (char *)&snap->entries[snap->count];
+    for (dev = g_devices.head, j = 0; dev; dev = dev->next, j++) {
+        fs = (dev->filesystem) ? dev->filesystem : "";
+
+        n = strlen(dev->devnode) + 1;
+        snap->entries[j].devnode = memcpy(p, dev->devnode, n);
+        p += n;
+        n = strlen(dev->mountpoint) + 1;
+        snap->entries[j].mountpoint = memcpy(p, dev->mountpoint, n);
+        p += n;
+        n = strlen(fs) + 1;
+        snap->entries[j].filesystem = memcpy(p, fs, n);
+        p += n;
+        snap->entries[j].state = dev->state;
+    }
+
+    old = __atomic_exchange_n(&g_snapshot, snap, __ATOMIC_SEQ_CST);
+    g_devices.dirty = 0;
+
+    if (old) {
+        old->retired = __atomic_fetch_add(&g_epoch, 1, __ATOMIC_SEQ_CST);
+        old->next = g_retired;
+        g_retired = old;
+    }
+
+    snapshot_reclaim();
+}
+
+static int
+status_write (int fd, const char *buf, size_t len)
+{
+    struct pollfd pfd;
+    ssize_t ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret > 0) {
+            buf += ret;
+            len -= (size_t)ret;
+            continue;
+        }
+        if (ret < 0 && errno != EAGAIN)
+            return 0;
+        /* A client that doesn't read is dropped */
+        if (poll(&pfd, 1, STATUS_TIMEOUT) <= 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void
+status_reply (int slot, int fd)
+{
+    struct snapshot_t *snap;
+    char line[PATH_MAX * 2 + 64];
+    int j, len;
+
+    /* The list follows */
+    if (!status_write(fd, "+", 1))
+        return;
+
+    __atomic_store_n(&g_reader_epoch[slot], __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    snap = __atomic_load_n(&g_snapshot, __ATOMIC_SEQ_CST);
+
+    for (j = 0; snap && j < snap->count; j++) {
+        len = snprintf(line, sizeof(line), "%s %s %s %s\n", 
+                snap->entries[j].devnode, 
+                snap->entries[j].mountpoint, 
+                snap->entries[j].filesystem, 
+                state_name(snap->entries[j].state));
+        if (len >= (int)sizeof(line))
+            continue;
+        if (!status_write(fd, line, (size_t)len))
+            break;
+    }
+
+    __atomic_store_n(&g_reader_epoch[slot], 0, __ATOMIC_SEQ_CST);
+}
+
+static void *
+status_main (void *arg)
+{
+    struct status_req_t *req;
+    int slot = (int)(intptr_t)arg;
+    int quit;
+
+    for (;;) {
+        pthread_mutex_lock(&g_status_lock);
+        while (!g_status_head && !g_status_quit)
+            pthread_cond_wait(&g_status_cond, &g_status_lock);
+        req = g_status_head;
+        if (req) {
+            g_status_head = req->next;
+            if (!g_status_head)
+                g_status_tail = NULL;
+        }
+        quit = g_status_quit;
+        pthread_mutex_unlock(&g_status_lock);
+
+        if (!req)
+            break;
+
+        if (!quit)
+            status_reply(slot, req->fd);
+        close(req->fd);
+        free(req);
+    }
+
+    return NULL;
+}
+
+int
+status_start (void)
+{
+    for (g_nstatus = 0; g_nstatus < STATUS_THREADS; g_nstatus++) {
+        if (pthread_create(&g_status_threads[g_nstatus], NULL, status_main, (void *)(intptr_t)g_nstatus))
+            break;
+    }
+
+    if (!g_nstatus) {
+        syslog(LOG_ERR, "Cannot spawn the status threads");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* The clients connect to a socket of ours, so the reply can only ever go
+ * back to whoever asked, and we get to know who that is */
+int
+status_listen (void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, STATUS_PATH);
+
+    unlink(STATUS_PATH);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || 
+        chmod(STATUS_PATH, 0666) < 0 || 
+        listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void
+status_accept (int fd)
+{
+    struct status_req_t *req;
+    struct ucred cred;
+    socklen_t len;
+    int client;
+
+    while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        /* Only root and the user we're mounting for may look */
+        len = sizeof(cred);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || 
+            (cred.uid != 0 && cred.uid != (uid_t)g_uid)) {
+            /* So the client can tell it from an empty list */
+            write(client, "-", 1);
+            close(client);
+            continue;
+        }
+
+        req = (g_nstatus) ? malloc(sizeof(struct status_req_t)) : NULL;
+        if (!req) {
+            close(client);
+            continue;
+        }
+
+        req->fd = client;
+        req->next = NULL;
+
+        pthread_mutex_lock(&g_status_lock);
+        if (g_status_tail)
+            g_status_tail->next = req;
+        else
+            g_status_head = req;
+        g_status_tail = req;
+        pthread_cond_signal(&g_status_cond);
+        pthread_mutex_unlock(&g_status_lock);
+    }
+}
+
+void
+status_stop (void)
+{
+    struct snapshot_t *snap;
+    int j;
+
+    pthread_mutex_lock(&g_status_lock);
+    g_status_quit = 1;
+    pthread_cond_broadcast(&g_status_cond);
+    pthread_mutex_unlock(&g_status_lock);
+
+    for (j = 0; j < g_nstatus; j++)
+        pthread_join(g_status_threads[j], NULL);
+    g_nstatus = 0;
+
+    free(g_snapshot);
+    g_snapshot = NULL;
+
+    while ((snap = g_retired)) {
+        g_retired = snap->next;
+        free(snap);
+    }
+}
+
+/* The client side of it */
+int
+status_query (void)
+{
+    struct sockaddr_un addr;
+    char buf[4096];
+    struct pollfd pfd;
+    ssize_t len;
+    int fd, ret = 0, started = 0;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, STATUS_PATH);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return 0;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (poll(&pfd, 1, STATUS_TIMEOUT) > 0) {
+        len = read(fd, buf, sizeof(buf));
+        /* The first byte says whether we're allowed to look */
+        if (len > 0 && !started) {
+            if (buf[0] != '+') {
+                fprintf(stderr, "Permission denied\n");
+                break;
+            }
+            started = 1;
+            fwrite(buf + 1, 1, (size_t)len - 1, stdout);
+            continue;
+        }
+        if (len > 0) {
+            fwrite(buf, 1, (size_t)len, stdout);
+            continue;
+        }
+        /* The daemon is done */
+        if (len == 0)
+            ret = started;
+        if (len == 0 || errno != EINTR)
+            break;
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+void
+handle_ipc_event (char *msg)
+{
+    struct device_t *device;
+
+    /* Keep it simple */
+    switch (msg[0]) {
+        case 'R': /* R for Remove */
+            /* Strip the trailing slash. Brutally. */
+            if (msg[1] && msg[strlen(msg) - 1] == '/')
+                msg[strlen(msg) - 1] = '\0';
+
+            device = device_search(msg + 1);
+
+            if (device && device->state != DEVICE_STATE_PROBING)
+                device_event(EVENT_REMOVE, device->props);
+
+            break;
+    }
+}
+
+/* Drop the devices that have been unmounted behind our back, only the 
+ * mounts that went away are looked at */
+static void
+mtab_forget (struct mount_t *gone)
+{
+    struct mount_t *next;
+    struct device_t *dev;
+
+    for (; gone; gone = next) {
+        next = gone->next;
+
+        dev = device_search_devnum(gone->devnum);
+        if (!dev && gone->source)
+            dev = device_search(gone->source);
+
+        /* The ones still being worked on are taken care of by the completion */
+        if (dev && dev->state == DEVICE_STATE_MOUNTED && !device_is_mounted(dev->props))
+            device_release(dev);
+
+        free(gone);
+    }
+}
+
+/* Refresh the whole mount table */
+int
+mtab_reload (void)
+{
+    struct mount_t *gone;
+
+    gone = NULL;
+
+    if (!mtab_parse(&gone)) {
+        syslog(LOG_ERR, "Error while parsing %s", MTAB_PATH);
+        return 0;
+    }
+
+    mtab_forget(gone);
+
+    return 1;
+}
+
+/* Account for the changes we made ourselves, the index is patched right
+ * away and the notification they trigger doesn't need a reload */
+void
+mtab_self_mount (struct device_t *device, uint64_t id)
+{
+    if (!id || htable_find_num(&g_mtab.ids, id))
+        return;
+
+    if (mtab_add(id, device->devnum, device->devnode, device->mountpoint))
+        g_mtab.self_changes++;
+}
+
+void
+mtab_self_unmount (struct device_t *device)
+{
+    struct mount_t *mnt;
+
+    mnt = mtab_find(device->devnum, device->devnode);
+
+    if (mnt && !strcmp(mnt->target, device->mountpoint)) {
+        mtab_remove(mnt);
+        free(mnt);
+        g_mtab.self_changes++;
+    }
+}
+
+/* A notification is worth a reload only if it's more than what we did
+ * ourselves; even then the reloads are spaced at least MTAB_INTERVAL apart.
+ * Since a single notification can't tell the two apart, a skipped one is
+ * verified anyway within MTAB_MAX_STALE */
+static void
+mtab_arm (int64_t deadline)
+{
+    int64_t now = now_msec();
+
+    if (g_mtab.timer_deadline && g_mtab.timer_deadline <= deadline)
+        return;
+
+    g_mtab.timer_deadline = deadline;
+    ev_timer_arm(&g_mtab.timer, (deadline > now) ? (long)(deadline - now) : 1);
+}
+
+static void
+on_mtab_timeout (struct ev_timer_t *timer)
+{
+    int64_t now = now_msec();
+
+    (void)timer;
+
+    g_mtab.timer_deadline = 0;
+
+    if (g_mtab.notified > g_mtab.self_changes || 
+        (g_mtab.verify_deadline && now >= g_mtab.verify_deadline)) {
+        if (!mtab_reload())
+            g_running = 0;
+        g_mtab.last_reload = now;
+        g_mtab.notified = g_mtab.self_changes = 0;
+        g_mtab.verify_deadline = 0;
+        return;
+    }
+
+    /* All our own doing */
+    if (g_mtab.notified) {
+        g_mtab.notified = g_mtab.self_changes = 0;
+        if (!g_mtab.verify_deadline)
+            g_mtab.verify_deadline = now + MTAB_MAX_STALE;
+    }
+
+    if (g_mtab.verify_deadline)
+        mtab_arm(g_mtab.verify_deadline);
+}
+
+int
+mtab_notify_init (void)
+{
+    return ev_timer_init(&g_mtab.timer, on_mtab_timeout, NULL);
+}
+
+void
+mtab_notify (void)
+{
+    int64_t deadline;
+
+    g_mtab.notified++;
+
+    deadline = now_msec() + MTAB_COALESCE;
+    if (deadline < g_mtab.last_reload + MTAB_INTERVAL)
+        deadline = g_mtab.last_reload + MTAB_INTERVAL;
+
+    mtab_arm(deadline);
+}
+
+/* Subscribe to the mount attach/detach events of our namespace. They carry
+ * the unique mount id so they're only useful with the listmount backend */
+int
+mtab_watch_open (void)
+{
+    int fd, nsfd;
+
+    if (g_mtab.backend != MTAB_LISTMOUNT)
+        return -1;
+
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_MNT | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    nsfd = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+
+    if (nsfd < 0 || 
+        fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MNTNS, FAN_MNT_ATTACH | FAN_MNT_DETACH, nsfd, NULL) < 0) {
+        if (nsfd >= 0)
+            close(nsfd);
+        close(fd);
+        return -1;
+    }
+
+    close(nsfd);
+
+    return fd;
+}
+
+/* Apply the single mount events, no rescan needed */
+static void
+mtab_handle_events (int fd)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+    struct fanotify_event_metadata *ev;
+    struct ldm_fan_info_mnt *info;
+    struct mount_t *gone, *mnt;
+    int overflow;
+    ssize_t len;
+    char *p;
+
+    gone = NULL;
+    overflow = 0;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (ev = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+            if (ev->mask & FAN_Q_OVERFLOW) {
+                overflow = 1;
+                continue;
+            }
+
+            info = NULL;
+            for (p = (char *)ev + ev->metadata_len; p + sizeof(struct fanotify_event_info_header) <= (char *)ev + ev->event_len;) {
+                struct fanotify_event_info_header *hdr = (struct fanotify_event_info_header *)p;
+
+                if (hdr->info_type == FAN_EVENT_INFO_TYPE_MNT && hdr->len >= sizeof(struct ldm_fan_info_mnt))
+                    info = (struct ldm_fan_info_mnt *)p;
+                if (!hdr->len)
+                    break;
+                p += hdr->len;
+            }
+
+            if (!info)
+                continue;
+
+            /* A move is a detach followed by an attach */
+            if (ev->mask & FAN_MNT_DETACH) {
+                mnt = htable_find_num(&g_mtab.ids, info->mnt_id);
+                if (mnt) {
+                    mtab_remove(mnt);
+                    mnt->next = gone;
+                    gone = mnt;
+                }
+            }
+            if (ev->mask & FAN_MNT_ATTACH) {
+                if (!htable_find_num(&g_mtab.ids, info->mnt_id))
+                    mtab_statmount(info->mnt_id);
+            }
+        }
+    }
+
+    mtab_forget(gone);
+
+    /* We lost track, start over */
+    if (overflow && !mtab_reload())
+        g_running = 0;
+}
+
+/* Cold start. The devices found at startup are queued by priority (the ones
+ * with an fstab entry first, then the volumes, then the rest) and handed to
+ * the workers a few at a time from the main loop, so that the hotplug events
+ * never wait behind a whole shelf of disks */
+
+static int
+coldplug_class (struct props_t *props)
+{
+    struct fstab_key_t *entry;
+
+    entry = fstab_lookup(&g_fstab_index, props);
+    if (entry && !entry->noauto)
+        return 0;
+    if (props->id_type && !strcmp(props->id_type, "cd"))
+        return 2;
+    return 1;
+}
+
+void
+coldplug_next (void)
+{
+    struct props_t *props;
+
+    while (g_running && g_coldplug_next < g_ncoldplug && g_jobs_inflight < g_parallel) {
+        props = g_coldplug[g_coldplug_next];
+        g_coldplug[g_coldplug_next++] = NULL;
+
+        if (!device_is_mounted(props))
+            device_mount(props);
+        props_unref(props);
+    }
+
+    if (g_coldplug_next == g_ncoldplug)
+        coldplug_clear();
+}
+
+void
+coldplug_clear (void)
+{
+    size_t j;
+
+    for (j = g_coldplug_next; j < g_ncoldplug; j++)
+        props_unref(g_coldplug[j]);
+
+    free(g_coldplug);
+    g_coldplug = NULL;
+    g_ncoldplug = g_coldplug_next = 0;
+}
+
+/* Ignore rules. The devtype ones end up in the monitor socket filter, the
+ * rest are checked before anything is allocated for the device. The rules
+ * are never touched after the startup so the enumeration threads can read
+ * them as they please */
+
+static int
+ignore_add (const char *rule)
+{
+    static const char *kinds[] = { "devtype:", "name:", "major:", "tag:" };
+    struct ignore_t *ig;
+    const char *value;
+    char *end;
+    int j;
+
+    if (g_nignore == MAX_IGNORE)
+        return 0;
+
+    for (j = 0; j < 4; j++) {
+        if (!strncmp(rule, kinds[j], strlen(kinds[j])))
+            break;
+    }
+    if (j == 4)
+        return 0;
+
+    value = rule + strlen(kinds[j]);
+    if (!*value)
+        return 0;
+
+    ig = &g_ignore[g_nignore];
+    ig->kind = j;
+    ig->value = value;
+    ig->len = strlen(value);
+
+    if (ig->kind == IGNORE_MAJOR) {
+        ig->major = (unsigned int)strtoul(value, &end, 10);
+        if (*end)
+            return 0;
+    }
+
+    g_nignore++;
+
+    return 1;
+}
+
+static int
+ignore_match (int kind, const char *value, unsigned int maj)
+{
+    int j;
+
+    for (j = 0; j < g_nignore; j++) {
+        if (g_ignore[j].kind != kind)
+            continue;
+        switch (kind) {
+            case IGNORE_MAJOR:
+                if (g_ignore[j].major == maj)
+                    return 1;
+                break;
+            case IGNORE_NAME:
+                if (value && !strncmp(value, g_ignore[j].value, g_ignore[j].len))
+                    return 1;
+                break;
+            default:
+                if (value && !strcmp(value, g_ignore[j].value))
+                    return 1;
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static int
+ignore_device (struct udev_device *dev)
+{
+    struct udev_list_entry *entry;
+
+    if (ignore_match(IGNORE_NAME, udev_device_get_sysname(dev), 0) ||
+        ignore_match(IGNORE_MAJOR, NULL, major(udev_device_get_devnum(dev))) ||
+        ignore_match(IGNORE_DEVTYPE, udev_device_get_devtype(dev), 0))
+        return 1;
+
+    udev_list_entry_foreach(entry, udev_device_get_tags_list_entry(dev)) {
+        if (ignore_match(IGNORE_TAG, udev_list_entry_get_name(entry), 0))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* The kernel only knows how to match on what we want, so the devtypes that
+ * aren't ignored are listed instead. Block devices are either disks or 
+ * partitions, anything else is left to ignore_device */
+static int
+ignore_filter (struct udev_monitor *monitor)
+{
+    static const char *devtypes[] = { "disk", "partition" };
+    int j, n = 0;
+
+    for (j = 0; j < 2; j++) {
+        if (ignore_match(IGNORE_DEVTYPE, devtypes[j], 0))
+            continue;
+        if (udev_monitor_filter_add_match_subsystem_devtype(monitor, "block", devtypes[j]))
+            return 0;
+        n++;
+    }
+
+    /* Everything's ignored, let ignore_device sort it out */
+    if (!n && udev_monitor_filter_add_match_subsystem_devtype(monitor, "block", NULL))
+        return 0;
+
+    return 1;
+}
+
+/* Startup enumeration, straight from sysfs and the udev database rather
+ * than through libudev: the devices we never care about are dropped as
+ * soon as we know enough about them, and the records are read by a few
+ * threads at once. The strings are interned back on the main thread */
+
+static ssize_t
+read_file (const char *path, char *buf, size_t size)
+{
+    ssize_t len, ret = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    while ((size_t)ret < size - 1 && (len = read(fd, buf + ret, size - 1 - (size_t)ret)) > 0)
+        ret += len;
+
+    close(fd);
+    buf[ret] = '\0';
+
+    return ret;
+}
+
+/* Make a snapshot from /sys/class/block/<name> and /run/udev/data, the
+ * same places libudev reads from. Returns NULL if the device is not worth
+ * looking at */
+static struct props_t *
+props_from_sysfs (const char *name)
+{
+    struct props_draft_t draft;
+    struct props_t *props = &draft.props;
+    char path[PATH_MAX], buf[16384], devnode[PATH_MAX];
+    char *line, *next, *val;
+    unsigned int maj = 0, mnr = 0;
+    const char *devname = NULL;
+
+    props_draft_init(&draft);
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/size", name);
+    if (read_file(path, buf, sizeof(buf)) <= 0)
+        return NULL;
+    props->size = udev_get_u64(buf);
+
+    /* No media, unbound loop devices and such */
+    if (!props->size)
+        return NULL;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/uevent", name);
+    if (read_file(path, buf, sizeof(buf)) <= 0)
+        return NULL;
+
+    for (line = buf; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        val = strchr(line, '=');
+        if (!val)
+            continue;
+        *val++ = '\0';
+
+        if (!strcmp(line, "MAJOR"))
+            maj = (unsigned int)strtoul(val, NULL, 10);
+        else if (!strcmp(line, "MINOR"))
+            mnr = (unsigned int)strtoul(val, NULL, 10);
+        else if (!strcmp(line, "DEVNAME"))
+            devname = val;
+        else if (!strcmp(line, "DEVTYPE"))
+            props->devtype = props_copy(&draft, val);
+        else if (!strcmp(line, "DISKSEQ"))
+            props->diskseq = udev_get_u64(val);
+    }
+
+    if (!devname || ignore_match(IGNORE_MAJOR, NULL, maj) ||
+        ignore_match(IGNORE_DEVTYPE, props->devtype, 0))
+        return NULL;
+
+    props->devnum = makedev(maj, mnr);
+    snprintf(devnode, sizeof(devnode), "/dev/%s", devname);
+    props->devnode = props_copy(&draft, devnode);
+
+    snprintf(path, sizeof(path), "/run/udev/data/b%u:%u", maj, mnr);
+    if (read_file(path, buf, sizeof(buf)) < 0)
+        return props_pack(&draft);
+
+    for (line = buf; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        if (line[1] != ':')
+            continue;
+
+        /* Symlinks, relative to /dev */
+        if (line[0] == 'S') {
+            if (props->ndevlinks == MAX_DEVLINKS)
+                continue;
+            snprintf(devnode, sizeof(devnode), "/dev/%s", line + 2);
+            props->devlinks[props->ndevlinks] = props_copy(&draft, devnode);
+            if (props->devlinks[props->ndevlinks])
+                props->ndevlinks++;
+            continue;
+        }
+
+        if (line[0] == 'G' && ignore_match(IGNORE_TAG, line + 2, 0))
+            return NULL;
+
+        if (line[0] != 'E' || !(val = strchr(line + 2, '=')))
+            continue;
+        *val++ = '\0';
+        line += 2;
+
+        if (!strcmp(line, "ID_FS_TYPE"))
+            props->fs_type = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_FS_UUID"))
+            props->fs_uuid = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_FS_LABEL"))
+            props->fs_label = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_FS_USAGE"))
+            props->fs_usage = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_TYPE"))
+            props->id_type = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_SERIAL"))
+            props->serial = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_PART_ENTRY_UUID"))
+            props->part_uuid = props_copy(&draft, val);
+        else if (!strcmp(line, "ID_CDROM_MEDIA"))
+            props->cdrom_media = 1;
+    }
+
+    return props_pack(&draft);
+}
+
+typedef struct enum_job_t {
+    char               (*names)[NAME_MAX + 1];
+    struct props_t     **props;
+    size_t               count;
+    size_t               next;
+} enum_job_t;
+
+static void *
+enum_main (void *arg)
+{
+    struct enum_job_t *job = arg;
+    size_t j;
+
+    while ((j = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        job->props[j] = props_from_sysfs(job->names[j]);
+
+    return NULL;
+}
+
+/* Returns the snapshots of the block devices around, NULL on failure */
+static struct props_t **
+enum_block_devices (size_t *count)
+{
+    struct enum_job_t job;
+    pthread_t threads[ENUM_THREADS];
+    struct props_t **ret;
+    struct dirent *ent;
+    DIR *dir;
+    void *tmp;
+    size_t size = 0, j, n;
+    int nthreads = 0;
+
+    memset(&job, 0, sizeof(job));
+
+    dir = opendir("/sys/class/block");
+    if (!dir)
+        return NULL;
+
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.' || ignore_match(IGNORE_NAME, ent->d_name, 0))
+            continue;
+
+        if (job.count == size) {
+            tmp = realloc(job.names, (size + 64) * sizeof(*job.names));
+            if (!tmp)
+                break;
+            job.names = tmp;
+            size += 64;
+        }
+
+        strcpy(job.names[job.count++], ent->d_name);
+    }
+
+    closedir(dir);
+
+    job.props = calloc(job.count + 1, sizeof(struct props_t *));
+    if (!job.props) {
+        free(job.names);
+        return NULL;
+    }
+
+    /* Not worth a thread for a handful of devices */
+    if (job.count > ENUM_BATCH) {
+        for (; nthreads < ENUM_THREADS; nthreads++) {
+            if (pthread_create(&threads[nthreads], NULL, enum_main, &job))
+                break;
+        }
+    }
+    enum_main(&job);
+    while (nthreads--)
+        pthread_join(threads[nthreads], NULL);
+
+    /* Back on the main thread, drop the misses and intern what's shared */
+    ret = job.props;
+    for (j = 0, n = 0; j < job.count; j++) {
+        if (!ret[j])
+            continue;
+        ret[j]->devtype = intern(ret[j]->devtype);
+        ret[j]->fs_type = intern(ret[j]->fs_type);
+        ret[j]->fs_usage = intern(ret[j]->fs_usage);
+        ret[j]->id_type = intern(ret[j]->id_type);
+        ret[n++] = ret[j];
+    }
+
+    free(job.names);
+
+    *count = n;
+
+    return ret;
+}
+
+void
+mount_plugged_devices (void)
+{
+    struct props_t **found;
+    size_t nfound, j, n;
+    int class, *classes;
+
+    coldplug_clear();
+
+    found = enum_block_devices(&nfound);
+    if (!found)
+        return;
+
+    for (j = 0, n = 0; j < nfound; j++) {
+        if (device_is_mounted(found[j]))
+            props_unref(found[j]);
+        else
+            found[n++] = found[j];
+    }
+    nfound = n;
+
+    g_coldplug = (nfound) ? malloc(nfound * sizeof(struct props_t *)) : NULL;
+    classes = (g_coldplug) ? malloc(nfound * sizeof(int)) : NULL;
+
+    if (!classes) {
+        for (j = 0; j < nfound; j++)
+            props_unref(found[j]);
+        free(found);
+        free(g_coldplug);
+        g_coldplug = NULL;
+        return;
+    }
+
+    for (j = 0; j < nfound; j++)
+        classes[j] = coldplug_class(found[j]);
+
+    /* Keep the enumeration order within a class */
+    for (class = 0; class < 3; class++) {
+        for (j = 0; j < nfound; j++) {
+            if (classes[j] == class)
+                g_coldplug[g_ncoldplug++] = found[j];
+        }
+    }
+
+    free(classes);
+    free(found);
+}
+
+int
+daemonize (void)
+{
+    pid_t child_pid;
+
+    child_pid = fork();
+
+    if (child_pid < 0)
+        return 0;
+
+    /* The parent writes the lock then exits */
+    if (child_pid > 0) {
+        lock_create(child_pid);
+        exit(0);
+    }
+
+    if (chdir("/") < 0) {
+        perror("chdir");
+        return 0;
+    }
+
+    umask(022);
+
+    if (setsid() < 0) {
+        perror("setsid");
+        return 0;
+    }
+
+    /* Close std* descriptors */
+    close(0);
+    close(1);
+    close(2);
+
+    return 1;
+}
+
+int 
+force_reload_table (struct libmnt_table **table, const char *path)
+{
+    if (table && *table)
+        mnt_free_table(*table);
+
+    *table = mnt_new_table_from_file(path);
+
+    if (!*table)
+        syslog(LOG_ERR, "Error while parsing %s", path);
+
+    return (*table != NULL);
+}
+
+int
+fifo_open (int oldfd, const int mode)
+{
+    int fd;
+
+    if (oldfd)
+        close(oldfd);
+
+    if ((fd = open(FIFO_PATH, mode)) < 0) {
+        perror("open");
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Coalescing of bursty events. The events for a devnode are merged into
+ * their net effect until the window opened by the first one closes:
+ * add+change is an add, add+remove is nothing and remove+add is a change */
+
+int64_t
+now_msec (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+debounce_unlink (struct debounce_t *entry)
+{
+    htable_remove(&g_debounce, &entry->node);
+
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        g_debounce_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        g_debounce_tail = entry->prev;
+}
+
+static void
+debounce_free (struct debounce_t *entry)
+{
+    props_unref(entry->props);
+    slab_free(&g_debounce_slab, entry);
+}
+
+static void
+debounce_arm (void)
+{
+    int64_t left;
+
+    if (!g_debounce_head) {
+        ev_timer_arm(&g_debounce_timer, 0);
+        return;
+    }
+
+    left = g_debounce_head->deadline - now_msec();
+    /* Zero would disarm it */
+    ev_timer_arm(&g_debounce_timer, (left > 0) ? (long)left : 1);
+}
+
+static void
+on_debounce_timeout (struct ev_timer_t *timer)
+{
+    struct debounce_t *entry;
+    int64_t now;
+
+    (void)timer;
+
+    now = now_msec();
+
+    while ((entry = g_debounce_head) && entry->deadline <= now) {
+        debounce_unlink(entry);
+        device_event(entry->action, entry->props);
+        debounce_free(entry);
+    }
+
+    debounce_arm();
+}
+
+int
+debounce_init (void)
+{
+    if (!g_debounce_window)
+        return 1;
+
+    return htable_init(&g_debounce, 0) && 
+           ev_timer_init(&g_debounce_timer, on_debounce_timeout, NULL);
+}
+
+void
+debounce_event (int action, struct props_t *props)
+{
+    struct debounce_t *entry;
+    const char *devnode;
+
+    devnode = props->devnode;
+
+    if (!g_debounce_window || !devnode || action == EVENT_UNK) {
+        device_event(action, props);
+        return;
+    }
+
+    entry = htable_find(&g_debounce, devnode);
+
+    if (entry) {
+        switch (entry->action) {
+            case EVENT_ADD:
+                /* It came and went, nothing to do */
+                if (action == EVENT_REMOVE) {
+                    debounce_unlink(entry);
+                    debounce_free(entry);
+                    debounce_arm();
+                    return;
+                }
+                break;
+            case EVENT_CHANGE:
+                if (action == EVENT_REMOVE)
+                    entry->action = EVENT_REMOVE;
+                break;
+            case EVENT_REMOVE:
+                /* The media has been swapped */
+                if (action != EVENT_REMOVE)
+                    entry->action = EVENT_CHANGE;
+                break;
+        }
+
+        /* Keep the most recent view of the device, the key moves along */
+        props_unref(entry->props);
+        entry->props = props_ref(props);
+        entry->node.key = props->devnode;
+
+        return;
+    }
+
+    entry = slab_alloc(&g_debounce_slab);
+
+    if (!entry) {
+        device_event(action, props);
+        return;
+    }
+
+    entry->action = action;
+    entry->props = props_ref(props);
+    entry->deadline = now_msec() + g_debounce_window;
+
+    htable_insert(&g_debounce, &entry->node, props->devnode, 0, entry);
+
+    entry->prev = g_debounce_tail;
+    if (g_debounce_tail)
+        g_debounce_tail->next = entry;
+    else
+        g_debounce_head = entry;
+    g_debounce_tail = entry;
+
+    if (g_debounce_head == entry)
+        debounce_arm();
+}
+
+void
+debounce_clear (void)
+{
+    struct debounce_t *entry;
+
+    while ((entry = g_debounce_head)) {
+        debounce_unlink(entry);
+        debounce_free(entry);
+    }
+
+    ev_timer_free(&g_debounce_timer);
+    htable_free(&g_debounce);
+}
+
+/* Hand out whatever is waiting right away */
+static void
+debounce_flush (void)
+{
+    struct debounce_t *entry;
+
+    while ((entry = g_debounce_head)) {
+        debounce_unlink(entry);
+        device_event(entry->action, entry->props);
+        debounce_free(entry);
     }
 
-    fstab_entry = fstab_search(g_fstab, device->udev);
+    debounce_arm();
+}
 
-    if (!device_has_media(device)) {
-        device_destroy(device);
-        return NULL;
+/* Resync. When the monitor socket overflows some events are gone for good,
+ * so once things calm down the block devices around are compared with the
+ * registry and only the differences are acted upon */
+
+static int
+resync_cmp (const void *a, const void *b)
+{
+    dev_t x = *(const dev_t *)a;
+    dev_t y = *(const dev_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+resync (void)
+{
+    struct props_t **found;
+    struct device_t *device, *next;
+    dev_t *devnums;
+    size_t nfound, j;
+    int added = 0, removed = 0, changed = 0;
+
+    /* What we did see goes first */
+    debounce_flush();
+
+    found = enum_block_devices(&nfound);
+    devnums = (found) ? malloc((nfound + 1) * sizeof(dev_t)) : NULL;
+
+    if (!devnums) {
+        syslog(LOG_ERR, "Cannot enumerate the block devices, the device list may be stale");
+        for (j = 0; found && j < nfound; j++)
+            props_unref(found[j]);
+        free(found);
+        return;
     }
 
-    device->mountpoint = (fstab_entry) ? 
-        s_strdup(mnt_fs_get_target(fstab_entry)) : 
-        device_create_mountpoint(device);
+    for (j = 0; j < nfound; j++)
+        devnums[j] = found[j]->devnum;
+    qsort(devnums, nfound, sizeof(dev_t), resync_cmp);
 
-    if (!device->mountpoint) {
-        syslog(LOG_ERR, "Couldn't make up a mountpoint name. Please report this bug.");
-        device_destroy(device);
-        return NULL;
+    /* Gone while we weren't looking */
+    for (device = g_devices.head; device; device = next) {
+        next = device->next;
+        if (bsearch(&device->devnum, devnums, nfound, sizeof(dev_t), resync_cmp))
+            continue;
+        if (device_event(EVENT_REMOVE, device->props))
+            removed++;
     }
 
-    if (!device_register(device)) {
-        device_destroy(device);
-        return NULL;
+    for (j = 0; j < nfound; j++) {
+        device = device_search_devnum(found[j]->devnum);
+
+        if (!device) {
+            if (!device_is_mounted(found[j]) && device_event(EVENT_ADD, found[j]))
+                added++;
+        } else if (device->state == DEVICE_STATE_MOUNTED && !device_same_media(device, found[j])) {
+            if (device_event(EVENT_CHANGE, found[j]))
+                changed++;
+        }
     }
 
-    return device;
+    for (j = 0; j < nfound; j++)
+        props_unref(found[j]);
+    free(found);
+    free(devnums);
+
+    syslog(LOG_INFO, "Resynced: %d added, %d removed, %d changed", added, removed, changed);
 }
 
-int
-device_mount (struct udev_device *dev)
+static void
+on_resync_timeout (struct ev_timer_t *timer)
 {
-    struct device_t *device;
-    struct libmnt_context *ctx;
-    char opt_fmt[256];
-    char *p;
-    int quirks;
- 
-    device = device_new(dev);
-
-    if (!device)
-        return 0;
-
-    mkdir(device->mountpoint, 755);
+    (void)timer;
 
-    p = opt_fmt;
+    g_resync_pending = 0;
+    resync();
+}
 
-    /* Some filesystems just want to watch the world burn */
-    quirks = filesystem_quirks(device->filesystem);
+/* The socket overflowed, let the storm settle before looking around */
+static void
+resync_schedule (void)
+{
+    if (g_resync_pending)
+        return;
 
-    if (quirks != QUIRK_NONE) {
-        /* Microsoft filesystems and filesystems used on optical 
-         * discs require the gid and uid to be passed as mount 
-         * arguments to allow the user to read and write, while 
-         * posix filesystems just need a chown after being mounted */
-        if (quirks & QUIRK_OWNER_FIX)
-            p += sprintf(p, OPT_FMT",", g_uid, g_gid);
-        if (quirks & QUIRK_UTF8_FLAG)
-            p += sprintf(p, "utf8,");
-    }
-    *p = 0;
+    syslog(LOG_WARNING, "The udev monitor overflowed, some events were lost");
 
-    ctx = mnt_new_context();
+    g_resync_pending = 1;
+    ev_timer_arm(&g_resync_timer, RESYNC_DELAY);
+}
 
-    mnt_context_set_fstype(ctx, device->filesystem);
-    mnt_context_set_source(ctx, device->devnode);
-    mnt_context_set_target(ctx, device->mountpoint);
-    mnt_context_set_options(ctx, opt_fmt);
+/* Raw uevent reader. libudev still sets up the socket and its filter, but
+ * the messages are read here in batches and only the properties we use are
+ * picked out of the receive buffer, no udev_device is ever built. Each
+ * snapshot is a single allocation */
 
-    if (device->type == DEVICE_CD) 
-        mnt_context_set_mflags(ctx, MS_RDONLY);
+static int
+uevent_init (int fd)
+{
+    struct uevent_ring_t *ring;
+    int on = 1;
+    int j;
 
-    if (mnt_context_mount(ctx)) {
-        syslog(LOG_ERR, "Error while mounting %s (%s)", device->devnode, strerror(errno));
-        mnt_free_context(ctx);
-        device_unmount(dev);
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
         return 0;
-    }
 
-    mnt_free_context(ctx);
+    ring = malloc(sizeof(struct uevent_ring_t));
+    if (!ring)
+        return 0;
 
-    if (!(quirks & QUIRK_OWNER_FIX)) {
-        if (chown(device->mountpoint, (__uid_t)g_uid, (__gid_t)g_gid)) {
-            syslog(LOG_ERR, "Cannot chown %s", device->mountpoint);
-            device_unmount(dev);
-            return 0;
-        }
+    memset(ring->msgs, 0, sizeof(ring->msgs));
+    for (j = 0; j < UEVENT_BATCH; j++) {
+        ring->iov[j].iov_base = ring->buf[j];
+        ring->iov[j].iov_len = UEVENT_BUF_SIZE;
+        ring->msgs[j].msg_hdr.msg_iov = &ring->iov[j];
+        ring->msgs[j].msg_hdr.msg_iovlen = 1;
+        ring->msgs[j].msg_hdr.msg_name = &ring->addr[j];
+        ring->msgs[j].msg_hdr.msg_control = ring->cmsg[j];
     }
 
-    spawn_helper(CALLBACK_PATH, "mount", device->mountpoint);
+    g_uevent_ring = ring;
 
     return 1;
 }
 
-int
-device_unmount (struct udev_device *dev)
+static void
+uevent_fini (void)
 {
-    struct device_t *device;
-    struct libmnt_context *ctx;
+    free(g_uevent_ring);
+    g_uevent_ring = NULL;
+}
 
-    device = device_search((char *)udev_device_get_devnode(dev));
+/* Only root may talk on the udev group, same checks libudev does */
+static int
+uevent_trusted (struct msghdr *hdr)
+{
+    struct sockaddr_nl *addr = hdr->msg_name;
+    struct cmsghdr *cmsg;
+    struct ucred *cred;
 
-    if (!device) 
+    if (hdr->msg_flags & (MSG_TRUNC | MSG_CTRUNC))
         return 0;
 
-    if (device_is_mounted(dev)) {
-        ctx = mnt_new_context();
-        mnt_context_set_target(ctx, device->devnode);
-        if (mnt_context_umount(ctx)) {
-            syslog(LOG_ERR, "Error while unmounting %s (%s)", device->devnode, strerror(errno));
-            mnt_free_context(ctx);
-            return 0;
-        }
-        mnt_free_context(ctx);
-    }
+    /* Unicast, nobody's supposed to send us those */
+    if (hdr->msg_namelen < sizeof(struct sockaddr_nl) || !addr->nl_groups)
+        return 0;
 
-    rmdir(device->mountpoint);
+    cmsg = CMSG_FIRSTHDR(hdr);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS)
+        return 0;
 
-    spawn_helper(CALLBACK_PATH, "unmount", device->mountpoint);
+    cred = (struct ucred *)CMSG_DATA(cmsg);
 
-    device_destroy(device);
-    
-    return 1;
+    return (cred->uid == 0);
 }
 
-int 
-device_change (struct udev_device *dev)
+static const char *
+uevent_value (const char *prop, const char *key, size_t len)
 {
-    struct device_t *device;
+    return (!strncmp(prop, key, len) && prop[len] == '=') ? prop + len + 1 : NULL;
+}
 
-    device = device_search((char *)udev_device_get_devnode(dev));
+#define UEVENT_KEY(p, k, f) \
+    if (!(f) && ((f) = (void *)uevent_value((p), (k), sizeof(k) - 1))) continue
 
-    /* Unmount the old media... */
-    if (device) {
-        if (device_is_mounted(dev) && !device_unmount(dev)) 
-            return 0;
-    }
-    /* ...and mount the new one if present */    
-    if (!device_mount(dev))
+static int
+uevent_parse (struct uevent_t *ev, char *buf, size_t len)
+{
+    struct uevent_hdr_t hdr;
+    char *p, *end;
+
+    if (len < sizeof(hdr))
         return 0;
 
-    return 1;
-}
+    memcpy(&hdr, buf, sizeof(hdr));
 
-void
-handle_ipc_event (int ipcfd, char *msg)
-{
-    struct device_t *device;
+    if (memcmp(hdr.prefix, "libudev", 8) || be32toh(hdr.magic) != UEVENT_MAGIC)
+        return 0;
+    if (hdr.properties_off < sizeof(hdr) || hdr.properties_len > len ||
+        hdr.properties_off > len - hdr.properties_len)
+        return 0;
 
-    /* Keep it simple */
-    switch (msg[0]) {
-        case 'R': /* R for Remove */
-            /* Strip the trailing slash. Brutally. */
-            if (msg[strlen(msg) - 1] == '/')
-                msg[strlen(msg) - 1] = '\0';
+    memset(ev, 0, sizeof(struct uevent_t));
+
+    p = buf + hdr.properties_off;
+    end = p + hdr.properties_len;
+
+    /* Don't run off the buffer if the last one isn't terminated */
+    if (hdr.properties_len)
+        end[-1] = '\0';
+
+    for (; p < end; p += strlen(p) + 1) {
+        UEVENT_KEY(p, "ACTION", ev->action);
+        UEVENT_KEY(p, "DEVPATH", ev->devpath);
+        UEVENT_KEY(p, "SUBSYSTEM", ev->subsystem);
+        UEVENT_KEY(p, "DEVNAME", ev->devname);
+        UEVENT_KEY(p, "DEVTYPE", ev->devtype);
+        UEVENT_KEY(p, "MAJOR", ev->major);
+        UEVENT_KEY(p, "MINOR", ev->minor);
+        UEVENT_KEY(p, "DISKSEQ", ev->diskseq);
+        UEVENT_KEY(p, "TAGS", ev->tags);
+        UEVENT_KEY(p, "DEVLINKS", ev->devlinks);
+        UEVENT_KEY(p, "ID_FS_TYPE", ev->fs_type);
+        UEVENT_KEY(p, "ID_FS_UUID", ev->fs_uuid);
+        UEVENT_KEY(p, "ID_FS_LABEL", ev->fs_label);
+        UEVENT_KEY(p, "ID_FS_USAGE", ev->fs_usage);
+        UEVENT_KEY(p, "ID_TYPE", ev->id_type);
+        UEVENT_KEY(p, "ID_SERIAL", ev->serial);
+        UEVENT_KEY(p, "ID_PART_ENTRY_UUID", ev->part_uuid);
+        if (uevent_value(p, "ID_CDROM_MEDIA", 14))
+            ev->cdrom_media = 1;
+    }
 
-            device = device_search(msg + 1);
+    return (ev->action && ev->devpath && ev->devname && ev->major && ev->minor &&
+            ev->subsystem && !strcmp(ev->subsystem, "block"));
+}
 
-            if (device && device_is_mounted(device->udev))
-                device_unmount(device->udev);
+#undef UEVENT_KEY
 
+static int
+uevent_ignored (struct uevent_t *ev)
+{
+    char tag[NAME_MAX + 1];
+    const char *p, *next;
+    size_t len;
+
+    if (ignore_match(IGNORE_NAME, strrchr(ev->devpath, '/') + 1, 0) ||
+        ignore_match(IGNORE_MAJOR, NULL, (unsigned int)strtoul(ev->major, NULL, 10)) ||
+        ignore_match(IGNORE_DEVTYPE, ev->devtype, 0))
+        return 1;
+
+    /* Tags come as :tag1:tag2: */
+    for (p = ev->tags; p && *p; p = next) {
+        next = strchr(++p, ':');
+        if (!next)
             break;
+        len = (size_t)(next - p);
+        if (!len || len > NAME_MAX)
+            continue;
+        memcpy(tag, p, len);
+        tag[len] = '\0';
+        if (ignore_match(IGNORE_TAG, tag, 0))
+            return 1;
     }
+
+    return 0;
 }
 
-void
-check_registered_devices (void)
+static struct props_t *
+props_from_uevent (struct uevent_t *ev)
 {
-    int j;
+    struct props_draft_t draft;
+    struct props_t *props = &draft.props;
+    char path[PATH_MAX], buf[32];
+    char *link, *next;
+
+    props_draft_init(&draft);
+
+    props->devnum = makedev((unsigned int)strtoul(ev->major, NULL, 10), (unsigned int)strtoul(ev->minor, NULL, 10));
+    props->diskseq = udev_get_u64(ev->diskseq);
+    props->cdrom_media = ev->cdrom_media;
+
+    /* There's nothing left to read once it's gone */
+    if (strcmp(ev->action, "remove")) {
+        snprintf(path, sizeof(path), "/sys%s/size", ev->devpath);
+        if (read_file(path, buf, sizeof(buf)) > 0)
+            props->size = udev_get_u64(buf);
+    }
 
-    /* Drop all the devices in the table that aren't mounted anymore */
-    for (j = 0; j < MAX_DEVICES; j++) {
-        if (g_devices[j] && !device_is_mounted(g_devices[j]->udev))
-            device_unmount(g_devices[j]->udev);
+    props->devtype = intern(ev->devtype);
+    props->fs_type = intern(ev->fs_type);
+    props->fs_usage = intern(ev->fs_usage);
+    props->id_type = intern(ev->id_type);
+
+    if (ev->devname[0] != '/') {
+        snprintf(path, sizeof(path), "/dev/%s", ev->devname);
+        props->devnode = props_copy(&draft, path);
+    } else
+        props->devnode = props_copy(&draft, ev->devname);
+
+    props->fs_uuid = props_copy(&draft, ev->fs_uuid);
+    props->fs_label = props_copy(&draft, ev->fs_label);
+    props->serial = props_copy(&draft, ev->serial);
+    props->part_uuid = props_copy(&draft, ev->part_uuid);
+
+    /* Space separated, split them in place */
+    for (link = ev->devlinks; link && *link; link = next) {
+        next = strchr(link, ' ');
+        if (next)
+            *next++ = '\0';
+        if (!*link)
+            continue;
+        if (props->ndevlinks == MAX_DEVLINKS)
+            break;
+        props->devlinks[props->ndevlinks] = props_copy(&draft, link);
+        if (!props->devlinks[props->ndevlinks])
+            break;
+        props->ndevlinks++;
     }
 
+    return props_pack(&draft);
 }
 
-void
-mount_plugged_devices (struct udev *udev)
-{    
-    const char *path;
-    struct udev_enumerate *udev_enum;
-    struct udev_list_entry *devices;
-    struct udev_list_entry *entry;
-    struct udev_device *dev;
+static void
+uevent_receive (int fd)
+{
+    struct uevent_ring_t *ring = g_uevent_ring;
+    struct msghdr *hdr;
+    struct uevent_t ev;
+    struct props_t *props;
+    int n, j;
+
+    for (;;) {
+        for (j = 0; j < UEVENT_BATCH; j++) {
+            ring->msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
+            ring->msgs[j].msg_hdr.msg_controllen = sizeof(ring->cmsg[j]);
+            ring->msgs[j].msg_hdr.msg_flags = 0;
+        }
+
+        n = recvmmsg(fd, ring->msgs, UEVENT_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            /* Some events were dropped, there may be more to read */
+            if (errno == ENOBUFS) {
+                resync_schedule();
+                continue;
+            }
+            if (errno != EAGAIN && errno != EINTR)
+                syslog(LOG_ERR, "recvmmsg() failed (%s)", strerror(errno));
+            return;
+        }
 
-    udev_enum = udev_enumerate_new(udev);
-    udev_enumerate_add_match_subsystem(udev_enum, "block");
-    udev_enumerate_scan_devices(udev_enum);
-    devices = udev_enumerate_get_list_entry(udev_enum);
+        for (j = 0; j < n; j++) {
+            hdr = &ring->msgs[j].msg_hdr;
+            if (!uevent_trusted(hdr) || 
+                !uevent_parse(&ev, ring->buf[j], ring->msgs[j].msg_len) ||
+                uevent_ignored(&ev))
+                continue;
 
-    udev_list_entry_foreach(entry, devices) {
-        path = udev_list_entry_get_name(entry);
-        dev = udev_device_new_from_syspath(udev, path);
+            g_fstab_cache_stale = 1;
+            props = props_from_uevent(&ev);
+            if (props)
+                debounce_event(event_action(ev.action), props);
+            props_unref(props);
+        }
 
-        if (!device_is_mounted(dev))
-            device_mount(dev);
-        udev_device_unref(dev);
+        if (n < UEVENT_BATCH)
+            break;
     }
-    udev_enumerate_unref(udev_enum);
 }
 
-void
-sig_handler (int signal)
+/* Event sources */
+
+static void
+on_udev_event (struct ev_source_t *src, uint32_t events)
 {
-    if (signal == SIGINT || signal == SIGTERM || signal == SIGHUP)
-        g_running = 0;
+    struct udev_monitor *monitor = src->data;
+    struct udev_device *device;
+    struct props_t *props;
+
+    (void)events;
+
+    for (;;) {
+        errno = 0;
+        device = udev_monitor_receive_device(monitor);
+        if (!device) {
+            /* Some events were dropped, there may be more to read */
+            if (errno != ENOBUFS)
+                break;
+            resync_schedule();
+            continue;
+        }
+        if (ignore_device(device)) {
+            udev_device_unref(device);
+            continue;
+        }
+        g_fstab_cache_stale = 1;
+        props = props_new(device);
+        if (props)
+            debounce_event(event_action(udev_device_get_action(device)), props);
+        udev_device_unref(device);
+        props_unref(props);
+    }
 }
 
-int
-daemonize (void)
+static void
+on_uevent_raw (struct ev_source_t *src, uint32_t events)
 {
-    pid_t child_pid;
+    (void)events;
 
-    child_pid = fork();
+    uevent_receive(src->fd);
+}
 
-    if (child_pid < 0)
-        return 0;
+static void
+on_fstab_event (struct ev_source_t *src, uint32_t events)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int changed = 0;
 
-    /* The parent writes the lock then exits */
-    if (child_pid > 0) {
-        lock_create(child_pid);
-        exit(0);
-    }
+    (void)events;
 
-    if (chdir("/") < 0) {
-        perror("chdir");
-        return 0;
+    /* The whole directory is watched as editors tend to replace the file,
+     * many events collapse into a single reload */
+    while ((len = read(src->fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, FSTAB_NAME))
+                changed = 1;
+        }
     }
 
-    umask(022);
+    /* Keep going with the old policy if the new one doesn't parse */
+    if (changed)
+        fstab_reload(src->data);
+}
 
-    if (setsid() < 0) {
-        perror("setsid");
-        return 0;
-    }
+static void
+on_mtab_event (struct ev_source_t *src, uint32_t events)
+{
+    (void)src;
+    (void)events;
 
-    /* Close std* descriptors */
-    close(0);
-    close(1);
-    close(2);
+    mtab_notify();
+}
 
-    return 1;
+static void
+on_mount_event (struct ev_source_t *src, uint32_t events)
+{
+    (void)events;
+
+    mtab_handle_events(src->fd);
 }
 
-int 
-force_reload_table (struct libmnt_table **table, const char *path)
+static void
+on_ipc_event (struct ev_source_t *src, uint32_t events)
 {
-    if (table && *table)
-        mnt_free_table(*table);
+    static char msg[PATH_MAX + 2];
+    static size_t msg_len;
+    char buf[4096];
+    ssize_t len, j;
+
+    (void)events;
+
+    /* Messages are newline terminated since more than a client might 
+     * have written to the fifo before we got to read it */
+    while ((len = read(src->fd, buf, sizeof(buf))) > 0) {
+        for (j = 0; j < len; j++) {
+            if (buf[j] != '\n') {
+                /* Too long, throw it away */
+                if (msg_len < sizeof(msg) - 1)
+                    msg[msg_len++] = buf[j];
+                continue;
+            }
+            msg[msg_len] = '\0';
+            if (msg_len > 0 && msg_len < sizeof(msg) - 1)
+                handle_ipc_event(msg);
+            msg_len = 0;
+        }
+    }
+}
 
-    *table = mnt_new_table_from_file(path);
+static void
+on_status_event (struct ev_source_t *src, uint32_t events)
+{
+    (void)events;
 
-    if (!*table)
-        syslog(LOG_ERR, "Error while parsing %s", path);
+    status_accept(src->fd);
+}
 
-    return (*table != NULL);
+static void
+on_workers_event (struct ev_source_t *src, uint32_t events)
+{
+    (void)src;
+    (void)events;
+
+    workers_complete();
+    coldplug_next();
 }
 
-int
-fifo_open (int oldfd, const int mode)
+static void
+on_signal (struct ev_source_t *src, uint32_t events)
 {
-    int fd;
+    struct signalfd_siginfo si;
 
-    if (oldfd)
-        close(oldfd);
+    (void)events;
 
-    if ((fd = open(FIFO_PATH, mode)) < 0) {
-        perror("open");
-        return -1;
+    while (read(src->fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM || si.ssi_signo == SIGHUP)
+            g_running = 0;
     }
-
-    return fd;
 }
 
 int
@@ -688,21 +5356,34 @@ main (int argc, char *argv[])
 {
     struct udev         *udev;
     struct udev_monitor *monitor;
-    struct udev_device  *device;
-    const  char         *action;
-    struct pollfd        pollfd[4];  /* udev / inotify watch / mtab / fifo */
+    struct ev_source_t   udev_src;
+    struct ev_source_t   fstab_src;
+    struct ev_source_t   mtab_src;
+    struct ev_source_t   ipc_src;
+    struct ev_source_t   status_src;
+    struct ev_source_t   workers_src;
+    struct ev_source_t   signal_src;
+    sigset_t             sigmask;
+    sigset_t             pipemask;
+    char                 msg[PATH_MAX + 2];
     int                  opt;
     int                  daemon;
     int                  notifyfd;
     int                  watchd;
     int                  ipcfd;
-    struct inotify_event event;
+    int                  statusfd;
+    int                  mtabfd;
+    int                  sigfd;
+    const char          *plugins[MAX_PLUGINS];
+    int                  nplugins;
+    int                  j;
 
     daemon  =  0;
+    nplugins = 0;
     g_uid   = -1;
     g_gid   = -1;
 
-    while ((opt = getopt(argc, argv, "hdg:u:r:")) != -1) {
+    while ((opt = getopt(argc, argv, "hdlng:u:r:p:w:j:i:b:")) != -1) {
         switch (opt) {
             case 'r':
                 ipcfd = fifo_open(-1, O_WRONLY);
@@ -710,28 +5391,67 @@ main (int argc, char *argv[])
                 if (ipcfd < 0)
                     return EXIT_FAILURE;
 
-                write(ipcfd, "R", 1);
-                write(ipcfd, optarg, strlen(optarg));
+                /* A single write so it doesn't get mixed with other clients */
+                write(ipcfd, msg, (size_t)snprintf(msg, sizeof(msg), "R%.*s\n", PATH_MAX, optarg));
                 close(ipcfd);
                 
                 return EXIT_SUCCESS;
+            case 'l':
+                return status_query() ? EXIT_SUCCESS : EXIT_FAILURE;
             case 'd':
                 daemon = 1;
                 break;
+            case 'n':
+                g_raw_uevents = 1;
+                break;
+            case 'b':
+                g_rcvbuf = (int)strtol(optarg, NULL, 10);
+                if (g_rcvbuf < 65536)
+                    g_rcvbuf = 65536;
+                break;
             case 'g':
                 g_gid = (int)strtoul(optarg, NULL, 10);
                 break;
             case 'u':
                 g_uid = (int)strtoul(optarg, NULL, 10);
                 break;
+            case 'p':
+                if (nplugins < MAX_PLUGINS)
+                    plugins[nplugins++] = optarg;
+                break;
+            case 'w':
+                g_debounce_window = strtol(optarg, NULL, 10);
+                if (g_debounce_window < 0)
+                    g_debounce_window = 0;
+                break;
+            case 'j':
+                g_parallel = (int)strtol(optarg, NULL, 10);
+                if (g_parallel < 1)
+                    g_parallel = 1;
+                if (g_parallel > MAX_WORKERS)
+                    g_parallel = MAX_WORKERS;
+                break;
+            case 'i':
+                if (!ignore_add(optarg)) {
+                    printf("Invalid ignore rule %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'h':
                 printf("ldm "VERSION_STR"\n");
                 printf("2011-2014 (C) The Lemon Man\n");
-                printf("%s [-d | -r | -g | -u | -h]\n", argv[0]);
+                printf("%s [-d | -r | -l | -g | -u | -p | -w | -j | -i | -n | -b | -h]\n", argv[0]);
                 printf("\t-d Run ldm as a daemon\n");
                 printf("\t-r Removes a mounted device\n");
+                printf("\t-l List the devices ldm is taking care of\n");
                 printf("\t-g Specify the gid\n");
                 printf("\t-u Specify the gid\n");
+                printf("\t-p Load a plugin (can be repeated)\n");
+                printf("\t-w Coalescing window for udev events in msec (0 disables it)\n");
+                printf("\t-j Number of mounts carried out in parallel\n");
+                printf("\t-i Ignore the devices matching devtype:, name:, major: or tag: (can be repeated)\n");
+                printf("\t-n Read the udev events straight off the netlink socket\n");
+                printf("\t-b Size of the udev receive buffer in bytes\n");
                 printf("\t-h Show this help\n");
                 /* Falltrough */
             default:
@@ -754,7 +5474,7 @@ main (int argc, char *argv[])
         return EXIT_SUCCESS;
     }
 
-    notifyfd = inotify_init();
+    notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
     if (notifyfd < 0) {
         perror("inotify_init");
@@ -770,11 +5490,19 @@ main (int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    ipcfd = fifo_open(-1, O_RDONLY | O_NONBLOCK);
+    /* Keep a writer around so that the fifo never hits EOF */
+    ipcfd = fifo_open(-1, O_RDWR | O_NONBLOCK | O_CLOEXEC);
 
     if (ipcfd < 0)
         return EXIT_FAILURE;
 
+    statusfd = status_listen();
+
+    if (statusfd < 0) {
+        perror("status socket");
+        return EXIT_FAILURE;
+    }
+
     if (daemon && !daemonize()) {
         printf("Could not spawn the daemon!\n");
         return EXIT_FAILURE;
@@ -782,9 +5510,28 @@ main (int argc, char *argv[])
 
     openlog("ldm", LOG_CONS, LOG_DAEMON);
 
-    signal(SIGTERM, sig_handler);
-    signal(SIGINT , sig_handler);
-    signal(SIGHUP , sig_handler);
+    /* Block the signals before any thread is spawned, they're all delivered 
+     * through the signalfd */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigmask, NULL);
+
+    /* A dead co-process should give us EPIPE, not kill us */
+    sigemptyset(&pipemask);
+    sigaddset(&pipemask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipemask, NULL);
+
+    g_coproc.fd = g_coproc.exit_src.fd = g_coproc.out_src.fd = g_coproc.restart.src.fd = -1;
+    g_debounce_timer.src.fd = -1;
+    g_mtab.timer.src.fd = -1;
+    g_resync_timer.src.fd = -1;
+
+    udev_src.fd = fstab_src.fd = mtab_src.fd = ipc_src.fd = status_src.fd = workers_src.fd = signal_src.fd = -1;
+    mtabfd = sigfd = watchd = -1;
+    udev = NULL;
+    monitor = NULL;
 
     syslog(LOG_INFO, "ldm "VERSION_STR);
     syslog(LOG_INFO, "Starting up...");
@@ -797,121 +5544,172 @@ main (int argc, char *argv[])
         syslog(LOG_ERR, "Cannot create a new monitor");
         goto cleanup;
     }
+    /* Room for the storms, we'll resync if it's not enough */
+    if (udev_monitor_set_receive_buffer_size(monitor, g_rcvbuf))
+        syslog(LOG_WARNING, "Cannot set the receive buffer size to %d", g_rcvbuf);
+
+    /* The filter is attached to the socket when receiving is enabled */
+    if (!ignore_filter(monitor)) {
+        syslog(LOG_ERR, "Cannot set the filter");
+        goto cleanup;
+    }    
     if (udev_monitor_enable_receiving(monitor)) {
         syslog(LOG_ERR, "Cannot enable receiving");   
         goto cleanup;
     }
-    if (udev_monitor_filter_add_match_subsystem_devtype(monitor, "block", NULL)) {
-        syslog(LOG_ERR, "Cannot set the filter");
-        goto cleanup;
-    }    
 
-    /* Clear the devices array */
-    device_list_clear();
+    /* Set up the device registry */
+    if (!htable_init(&g_devices.devnodes, 0) || 
+        !htable_init(&g_devices.mountpoints, 0) || 
+        !htable_init(&g_devices.devnums, 0)) {
+        syslog(LOG_ERR, "Cannot allocate the device registry");
+        goto cleanup;
+    }
 
     g_fstab = NULL;
-    g_mtab  = NULL;
 
-    /* The loop isn't active at this time so just do it by hand */
-    if (!force_reload_table(&g_fstab, FSTAB_PATH) || !force_reload_table(&g_mtab, MTAB_PATH))
+    if (!ev_init()) {
+        syslog(LOG_ERR, "Cannot create the event loop");
         goto cleanup;
+    }
 
-    mount_plugged_devices(udev);
+    if (!workers_init())
+        goto cleanup;
 
-    if (!force_reload_table(&g_fstab, FSTAB_PATH) || !force_reload_table(&g_mtab, MTAB_PATH))
+    if (!debounce_init()) {
+        syslog(LOG_ERR, "Cannot set up the event coalescing");
         goto cleanup;
-    
-    watchd = inotify_add_watch(notifyfd, FSTAB_PATH, IN_CLOSE_WRITE);
+    }
 
-    /* Register all the events */
-    pollfd[0].fd = udev_monitor_get_fd(monitor);
-    pollfd[0].events = POLLIN;
-    pollfd[1].fd = notifyfd;
-    pollfd[1].events = POLLIN;
-    pollfd[2].fd = open(MTAB_PATH, O_RDONLY | O_NONBLOCK);
-    pollfd[2].events = POLLERR;
-    pollfd[3].fd = ipcfd;
-    pollfd[3].events = POLLIN;
+    if (!ev_timer_init(&g_resync_timer, on_resync_timeout, NULL)) {
+        syslog(LOG_ERR, "Cannot set up the resync timer");
+        goto cleanup;
+    }
 
-    syslog(LOG_INFO, "Entering the main loop");
+    for (j = 0; j < nplugins; j++)
+        plugin_load(plugins[j]);
 
-    g_running = 1;
+    if (!plugins_start() || !status_start())
+        goto cleanup;
 
-    while (g_running) {
-        if (poll(pollfd, 4, -1) < 1)
-            continue;
+    if (COPROC_PATH && !coproc_start()) {
+        syslog(LOG_ERR, "Cannot start \"%s\", will retry later", g_coproc.path);
+        ev_timer_arm(&g_coproc.restart, COPROC_RESTART);
+    }
+
+    /* The loop isn't active at this time so just do it by hand */
+    if (!fstab_reload(NULL) || !mtab_reload() || !mountpoint_scan())
+        goto cleanup;
 
-        /* Incoming message on udev socket */
-        if (pollfd[0].revents & POLLIN) {
-            device = udev_monitor_receive_device(monitor);
+    mount_plugged_devices();
 
-            if (!device)
-                continue;
+    if (!fstab_reload(udev))
+        goto cleanup;
+    
+    watchd = inotify_add_watch(notifyfd, FSTAB_DIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+    /* Prefer the per-mount notifications, fall back to polling mountinfo */
+    mtabfd = mtab_watch_open();
+    if (mtabfd >= 0) {
+        syslog(LOG_INFO, "Using fanotify for the mount notifications");
+        if (!ev_add(&mtab_src, mtabfd, EPOLLIN, on_mount_event, NULL))
+            goto cleanup;
+    } else {
+        mtabfd = open(MTAB_PATH, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (mtabfd < 0 || !mtab_notify_init() || !ev_add(&mtab_src, mtabfd, EPOLLPRI, on_mtab_event, NULL)) {
+            syslog(LOG_ERR, "Cannot watch %s", MTAB_PATH);
+            goto cleanup;
+        }
+    }
 
-            action = udev_device_get_action(device);    
+    sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
 
-            if (!strcmp(action, "add"))
-                device_mount(device);
-            else if (!strcmp(action, "remove"))
-                device_unmount(device);
-            else if (!strcmp(action, "change"))
-                device_change(device);
+    if (sigfd < 0) {
+        syslog(LOG_ERR, "Cannot set up the event sources");
+        goto cleanup;
+    }
 
-            udev_device_unref(device);
-        }
-        /* Incoming message on inotify socket */
-        if (pollfd[1].revents & POLLIN) {
-            read(pollfd[1].fd, &event, sizeof(struct inotify_event)); 
+    /* Register all the events */
+    if (g_raw_uevents && !uevent_init(udev_monitor_get_fd(monitor))) {
+        syslog(LOG_WARNING, "Cannot set up the raw uevent reader, falling back on libudev");
+        g_raw_uevents = 0;
+    }
 
-            if (!force_reload_table(&g_fstab, FSTAB_PATH))
-                break;
-        }
-        /* mtab change */
-        if (pollfd[2].revents & POLLERR) {
-            if (!force_reload_table(&g_mtab, MTAB_PATH))
-                break;
-            check_registered_devices();
-        }
-        /* ipc message on the fifo */
-        if (pollfd[3].revents & POLLIN) {
-            int msg_len;
-            /* Get the exact message length */
-            if (ioctl(ipcfd, FIONREAD, &msg_len) < 0) {
-                perror("ioctl");
-                break;
-            }
+    if (!ev_add(&udev_src, udev_monitor_get_fd(monitor), EPOLLIN, 
+                g_raw_uevents ? on_uevent_raw : on_udev_event, monitor) ||
+        !ev_add(&fstab_src, notifyfd, EPOLLIN, on_fstab_event, udev) ||
+        !ev_add(&ipc_src, ipcfd, EPOLLIN, on_ipc_event, NULL) ||
+        !ev_add(&status_src, statusfd, EPOLLIN, on_status_event, NULL) ||
+        !ev_add(&workers_src, g_donefd, EPOLLIN, on_workers_event, NULL) ||
+        !ev_add(&signal_src, sigfd, EPOLLIN, on_signal, NULL))
+        goto cleanup;
 
-            char msg[msg_len];
-            if (read(ipcfd, msg, msg_len) != msg_len) {
-                perror("read");
-                break;
-            }
-            msg[msg_len] = '\0';
+    syslog(LOG_INFO, "Entering the main loop");
+
+    g_running = 1;
 
-            handle_ipc_event(ipcfd, msg);
+    /* The devices found at startup are mounted while the loop runs */
+    coldplug_next();
 
-            /* The fifo is closed once the other end finishes sending the data so just reopen it. */
-            pollfd[3].fd = ipcfd = fifo_open(ipcfd, O_RDONLY | O_NONBLOCK);
-        }
+    registry_publish();
+
+    while (g_running) {
+        if (!ev_run(-1))
+            break;
+        coproc_flush();
+        registry_publish();
     }
 
 cleanup:
     /* Do the cleanup */
-    inotify_rm_watch(notifyfd, watchd);
+    if (watchd >= 0)
+        inotify_rm_watch(notifyfd, watchd);
 
     close(ipcfd);
+    close(statusfd);
     close(notifyfd);
-    close(pollfd[2].fd);
+    if (mtabfd >= 0)
+        close(mtabfd);
+    if (sigfd >= 0)
+        close(sigfd);
 
     unlink(FIFO_PATH);
+    unlink(STATUS_PATH);
+
+    g_running = 0;
 
+    debounce_clear();
+    coldplug_clear();
     device_list_clear();
+    workers_stop();
+    helpers_flush();
+    coproc_stop();
+    plugins_stop();
+    status_stop();
+
+    if (g_epollfd >= 0)
+        close(g_epollfd);
+
+    htable_free(&g_devices.devnodes);
+    htable_free(&g_devices.mountpoints);
+    htable_free(&g_devices.devnums);
 
     udev_monitor_unref(monitor);
     udev_unref(udev);
+    uevent_fini();
 
     mnt_free_table(g_fstab);
-    mnt_free_table(g_mtab);
+    mnt_unref_cache(g_fstab_cache);
+    fstab_index_clear(&g_fstab_index);
+    ev_timer_free(&g_mtab.timer);
+    ev_timer_free(&g_resync_timer);
+    mtab_clear();
+    mountpoint_clear();
+    htable_free_all(&g_interned);
+    slab_destroy(&g_device_slab);
+    slab_destroy(&g_pending_slab);
+    slab_destroy(&g_debounce_slab);
+    slab_destroy(&g_job_slab);
 
     syslog(LOG_INFO, "Terminating...");
     lock_remove();
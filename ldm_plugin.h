@@ -0,0 +1,26 @@
+#ifndef LDM_PLUGIN_H
+#define LDM_PLUGIN_H
+
+/* ldm plugin interface. A plugin is a shared object loaded with `ldm -p`,
+ * exporting any of the hooks below. The hooks are called from a dedicated
+ * thread, one event at a time and in the same order the events happened.
+ * The event and its strings are only valid for the duration of the call. */
+
+#define LDM_PLUGIN_ABI 1
+
+typedef struct ldm_event {
+    int          abi;           /* LDM_PLUGIN_ABI */
+    const char  *action;        /* "mount" or "unmount" */
+    const char  *devnode;
+    const char  *mountpoint;
+    const char  *filesystem;
+} ldm_event;
+
+/* Return non zero to refuse being loaded */
+int  ldm_plugin_init (void);
+void ldm_plugin_fini (void);
+
+void on_mount (const ldm_event *ev);
+void on_unmount (const ldm_event *ev);
+
+#endif